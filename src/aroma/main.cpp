@@ -63,7 +63,7 @@ void make_server() {
         // Empty endpoint to allow for device discovery.
         server.when("/")->requested([](const HttpRequest &req) {
             return HttpResponse{200, "text/plain", "Ristretto"};
-        });
+        })->cacheFor();
 
         if (enableCEC) {
             registerCECEndpoints(server);
@@ -83,64 +83,71 @@ void registerTitleEndpoints(HttpServer &server) {
     });
 
     // NOT FOR HOMEBREW TITLES!!!!!!!
-    server.when("/title/list")->requested([](const HttpRequest &req) {
+    server.when("/title/list")->requested([](const HttpRequest &req) -> HttpTask<HttpResponse> {
         DEBUG_FUNCTION_LINE_INFO("Getting title list.");
-        int handle = MCP_Open();
-        if (handle < 0) { // some error?
-            throw std::runtime_error{"MCP_Open() failed with error " + std::to_string(handle)};
-        }
 
-        uint32_t outCount;
-        std::vector<MCPTitleListType> titleList(1000); // arbitrary number so we don't overflow
-        MCPError error = MCP_TitleList(handle, &outCount, titleList.data(), titleList.size() * sizeof(MCPTitleListType));
-        MCP_Close(handle);
-        if (error) {
-            DEBUG_FUNCTION_LINE_ERR("Error at MCP_TitleList");
-            return HttpResponse{500, "text/plain", "Couldn't get the title list! Error at MCP_TitleList"};
-        }
+        std::string list;
 
-        miniJson::Json::_object res;
-
-        // This is my first time trying this with C++ vectors, so lets see what happens.
-        // Ideally it will just keep rewriting to meta?
-        for (auto &title : titleList) {
-            ACPMetaXml meta alignas(0x40);
-
-            // not all titles are actual game titles
-            // TODO: For vWii titles, allow it under the condition we are able to
-            // send back to the server that Ristretto won't be active.
-            // All titles under MCP_APP_TYPE_GAME (or any Wii U system title) will
-            // allow for Ristretto control inside of it: not sure about homebrew.
-            //
-            // MCP_APP_TYPE_ACCOUNT_APPS do not work: these things like notifications, account settings,
-            // user settings, etc. will not launch or throw an error. (System Transfer for some reason
-            // is in this category??? But for console security it should not be exposed anyways).
-            if (title.appType == MCP_APP_TYPE_GAME ||
-                title.appType == MCP_APP_TYPE_GAME_WII ||
-                title.appType == MCP_APP_TYPE_SYSTEM_MENU ||
-                title.appType == MCP_APP_TYPE_SYSTEM_APPS ||
-                title.appType == MCP_APP_TYPE_SYSTEM_SETTINGS) {
-                ACPResult acpError = ACPGetTitleMetaXml(title.titleId, &meta);
-                if (acpError) {
-                    DEBUG_FUNCTION_LINE_ERR("Error at ACPGetTitleMetaXml. Title ID %d", title.titleId);
-                    continue;
-                }
+        // MCP_TitleList and the metadata of every title take a while, the whole list is built
+        // off the workers so they serve other clients meanwhile
+        MCPError error = co_await offloadBlocking([&list]() {
+            uint32_t outCount = 0;
+            std::vector<MCPTitleListType> titleList(1000); // arbitrary number so we don't overflow
+
+            int handle = MCP_Open();
+            if (handle < 0) { // some error?
+                throw std::runtime_error{"MCP_Open() failed with error " + std::to_string(handle)};
+            }
 
-                // TODO: Consider returning other languages
-                if (meta.longname_en[0] != '\0') {
-                    DEBUG_FUNCTION_LINE_INFO("Finished %s", meta.longname_en);
-                    try {
-                        res[std::to_string(title.titleId)] = getTitleLongname(&meta);
-                        DEBUG_FUNCTION_LINE_INFO("Written to JSON");
-                    } catch (std::exception &e) {
-                        DEBUG_FUNCTION_LINE_ERR("Failed to write title to JSON: %s\n", e.what());
+            MCPError error = MCP_TitleList(handle, &outCount, titleList.data(), titleList.size() * sizeof(MCPTitleListType));
+            MCP_Close(handle);
+            if (error)
+                return error;
+
+            titleList.resize(outCount);
+            list = "{";
+
+            for (auto &title : titleList) {
+                ACPMetaXml meta alignas(0x40);
+
+                // not all titles are actual game titles
+                // TODO: For vWii titles, allow it under the condition we are able to
+                // send back to the server that Ristretto won't be active.
+                // All titles under MCP_APP_TYPE_GAME (or any Wii U system title) will
+                // allow for Ristretto control inside of it: not sure about homebrew.
+                //
+                // MCP_APP_TYPE_ACCOUNT_APPS do not work: these things like notifications, account settings,
+                // user settings, etc. will not launch or throw an error. (System Transfer for some reason
+                // is in this category??? But for console security it should not be exposed anyways).
+                if (title.appType == MCP_APP_TYPE_GAME ||
+                    title.appType == MCP_APP_TYPE_GAME_WII ||
+                    title.appType == MCP_APP_TYPE_SYSTEM_MENU ||
+                    title.appType == MCP_APP_TYPE_SYSTEM_APPS ||
+                    title.appType == MCP_APP_TYPE_SYSTEM_SETTINGS) {
+                    ACPResult acpError = ACPGetTitleMetaXml(title.titleId, &meta);
+                    if (acpError) {
+                        DEBUG_FUNCTION_LINE_ERR("Error at ACPGetTitleMetaXml. Title ID %d", title.titleId);
+                    } else if (meta.longname_en[0] != '\0') { // TODO: Consider returning other languages
+                        DEBUG_FUNCTION_LINE_INFO("Finished %s", meta.longname_en);
+                        list += list.size() > 1 ? ",\"" : "\"";
+                        list += std::to_string(title.titleId);
+                        list += "\":";
+                        list += miniJson::Json{getTitleLongname(&meta)}.serialize();
+                    } else {
+                        DEBUG_FUNCTION_LINE_INFO("No English longname - not proceeding");
                     }
-                } else {
-                    DEBUG_FUNCTION_LINE_INFO("No English longname - not proceeding");
                 }
             }
+
+            list += "}";
+            return error;
+        });
+
+        if (error) {
+            DEBUG_FUNCTION_LINE_ERR("Error at MCP_TitleList");
+            co_return HttpResponse{500, "text/plain", "Couldn't get the title list! Error at MCP_TitleList"};
         }
 
-        return HttpResponse{200, res};
-    });
+        co_return HttpResponse{200, "application/json", std::move(list)};
+    })->compress();
 }
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Host builds of the benchmarks, each links the library sources directly.
+# json.h comes from the MiniJson submodule next to this library. CXXFLAGS=-U__SSE2__ times the
+# word loops the Wii U runs
+
+FLAGS="-O2 -Wall -std=c++23 -I.. -I../../MiniJson/Source/include $CXXFLAGS"
+SOURCES="../http.cpp ../websock.cpp"
+
+g++ $FLAGS mask.cpp $SOURCES -pthread -lz -o mask
+g++ $FLAGS reads.cpp $SOURCES -pthread -lz -o reads
+g++ $FLAGS parse.cpp $SOURCES -pthread -lz -o parse
+g++ $FLAGS routes.cpp $SOURCES -pthread -lz -o routes
+g++ $FLAGS compress.cpp $SOURCES -pthread -lz -o compress
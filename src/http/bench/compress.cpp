@@ -0,0 +1,67 @@
+// Gzips typical response bodies the way a route that compresses does, and times it. The level is
+// TINYHTTP_COMPRESS_LEVEL, build with CXXFLAGS=-DTINYHTTP_COMPRESS_LEVEL=9 to compare another one
+
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <string>
+
+#include "../http.hpp"
+
+static const char *kTitleNames[] = {"Mario Kart 8", "The Legend of Zelda: Breath of the Wild", "Super Smash Bros. for Wii U", "Splatoon",
+                                    "Nintendo Land", "Xenoblade Chronicles X", "Pikmin 3", "Bayonetta 2", "Wii U Menu", "System Settings",
+                                    "Mii Maker", "Nintendo eShop", "Internet Browser", "Donkey Kong Country: Tropical Freeze"};
+
+// /title/list for a console with 300 titles, title IDs mapped to names
+static std::string titleList() {
+    std::string list = "{";
+
+    for (int i = 0; i < 300; i++) {
+        char titleId[24];
+        snprintf(titleId, sizeof(titleId), "%llu", 0x0005000010100000ull + i * 0x1000ull);
+
+        std::string name = kTitleNames[i % std::size(kTitleNames)];
+        if (i >= static_cast<int>(std::size(kTitleNames)))
+            name += " " + std::to_string(i);
+
+        list += std::string{i ? ",\"" : "\""} + titleId + "\":\"" + name + "\"";
+    }
+
+    return list + "}";
+}
+
+int main() {
+    const int count = 2000;
+
+    struct {
+        const char *name;
+        std::string body;
+    } payloads[] = {
+            {"/title/list, 300 titles", titleList()},
+            {"device info JSON", "{\"serial\":\"FW123456789\",\"model\":\"WUP-101(02)\",\"version\":\"5.5.6U\",\"region\":\"USA\",\"language\":\"English\","
+                                 "\"battery\":\"charging\",\"storage\":{\"mlc\":25769803776,\"usb\":1000204886016}}"},
+            {"/title/current", "Mario Kart 8"},
+    };
+
+    printf("gzip at level %d, threshold %d bytes\n", TINYHTTP_COMPRESS_LEVEL, TINYHTTP_COMPRESS_MIN_SIZE);
+
+    for (auto &payload : payloads) {
+        size_t compressedSize = 0;
+        auto start            = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < count; i++) {
+            HttpResponse response{200, "application/json", payload.body};
+            response.compress(ContentCoding::GZIP);
+            compressedSize = response.content().size();
+        }
+
+        double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / count;
+
+        if (compressedSize < payload.body.size())
+            printf("%-24s %6zu -> %6zu bytes  %7.1f us\n", payload.name, payload.body.size(), compressedSize, microseconds);
+        else
+            printf("%-24s %6zu bytes, sent as it is\n", payload.name, payload.body.size());
+    }
+
+    return 0;
+}
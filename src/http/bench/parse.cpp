@@ -0,0 +1,148 @@
+// Parses a typical request head from memory 200000 times, one request object reused as a keep-alive
+// connection does, and counts the allocations that takes. The istringstream parser HttpRequest had
+// before runs on the same head as the baseline
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <iterator>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../http.hpp"
+
+// A typical Home Assistant poll, 187 bytes
+static constexpr std::string_view kRequest = "GET /gamepad/battery HTTP/1.1\r\nHost: 192.168.1.20:8572\r\n"
+                                             "User-Agent: HomeAssistant/2024.1 aiohttp/3.9.1 Python/3.11\r\n"
+                                             "Accept: */*\r\nAccept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n";
+
+static size_t gAllocations = 0;
+
+void *operator new(size_t size) {
+    gAllocations++;
+
+    if (void *memory = malloc(size))
+        return memory;
+
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *memory) noexcept { free(memory); }
+void operator delete(void *memory, size_t) noexcept { free(memory); }
+
+// Hands out the same head for every request
+struct MemoryStream : IClientStream {
+    bool isOpen() noexcept override { return true; }
+    void send(const void *what, size_t size) override {}
+    size_t receive(void *target, size_t max) override { return 0; }
+    std::string receiveLine(bool asciiOnly, size_t max) override { return {}; }
+    std::string_view receiveHead(size_t max) override { return kRequest; }
+    void close() override {}
+};
+
+// HttpRequest::parse() before, one line at a time into a std::map, with a new request per head
+struct BaselineRequest {
+    std::string method, path, query;
+    std::map<std::string, std::string> headers;
+};
+
+static bool parseBaseline(std::string_view head, BaselineRequest &request) {
+    // What receiveLine() returned, without the line endings
+    auto nextLine = [&head]() {
+        size_t end       = head.find('\n');
+        std::string line = std::string{head.substr(0, end)};
+        head.remove_prefix(end == std::string_view::npos ? head.size() : end + 1);
+
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        return line;
+    };
+
+    std::istringstream iss(nextLine());
+    std::vector<std::string> results(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
+
+    if (results.size() < 2)
+        return false;
+
+    request.method = results[0];
+    request.path   = results[1];
+
+    size_t question = request.path.find("?");
+    if (question != std::string::npos) {
+        request.query = request.path.substr(question);
+        request.path  = request.path.substr(0, question);
+    }
+
+    while (true) {
+        std::string line = nextLine();
+
+        if (line.empty()) break;
+
+        size_t sep = line.find(": ");
+        if (sep == std::string::npos || sep == 0)
+            return false;
+
+        std::string key = line.substr(0, sep), val = line.substr(sep + 2);
+        request.headers[key] = val;
+    }
+
+    return true;
+}
+
+static void report(const char *name, int count, double seconds, size_t allocations) {
+    printf("%-8s %d requests of %zu bytes: %8.0f requests/s, %5.2f allocations per request\n", name, count, kRequest.size(),
+           count / seconds, double(allocations) / count);
+}
+
+int main() {
+    const int count = 200000;
+
+    // Before
+    size_t allocations = gAllocations;
+    auto start         = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < count; i++) {
+        BaselineRequest request;
+
+        if (!parseBaseline(kRequest, request) || request.headers["Connection"] != "keep-alive") {
+            puts("Request wasn't parsed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double baselineSeconds     = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t baselineAllocations = gAllocations - allocations;
+
+    // Now, the library logs every request it parses
+    std::cout.setstate(std::ios::failbit);
+
+    auto stream = std::make_shared<MemoryStream>();
+    HttpRequest request;
+
+    // The first request sizes the buffers that the others reuse
+    request.parse(stream);
+
+    allocations = gAllocations;
+    start       = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < count; i++) {
+        if (!request.parse(stream) || request.header("connection") != "keep-alive") {
+            puts("Request wasn't parsed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    report("before", count, baselineSeconds, baselineAllocations);
+    report("now", count, seconds, gAllocations - allocations);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Counts the recv() calls it takes to read 1000 keep-alive requests, the way a client that waits for
+// every response sends them. The same requests go through the per-byte reader TCPClientStream had
+// before and through the buffered one
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+#include "../http.hpp"
+
+// A typical Home Assistant poll, 187 bytes
+static constexpr std::string_view kRequest = "GET /gamepad/battery HTTP/1.1\r\nHost: 192.168.1.20:8572\r\n"
+                                             "User-Agent: HomeAssistant/2024.1 aiohttp/3.9.1 Python/3.11\r\n"
+                                             "Accept: */*\r\nAccept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n";
+
+static size_t gReceiveCalls = 0;
+
+// Takes the place of libc's recv() for the library code linked into this program
+extern "C" ssize_t recv(int socket, void *buffer, size_t length, int flags) {
+    gReceiveCalls++;
+    return recvfrom(socket, buffer, length, flags, nullptr, nullptr);
+}
+
+// TCPClientStream::receiveLine() before the read buffer, one recv() for each byte
+static std::string receiveLineBytewise(int socket) {
+    std::string res;
+    char ch;
+
+    while (true) {
+        if (recv(socket, &ch, 1, MSG_NOSIGNAL) != 1)
+            throw std::runtime_error("TCP receive failed");
+
+        if (ch == '\r') continue;
+        if (ch == '\n') break;
+
+        if (!isascii(ch))
+            throw std::runtime_error("Only ASCII characters were allowed");
+
+        res.push_back(ch);
+    }
+
+    return res;
+}
+
+static void sendRequest(int socket) {
+    if (send(socket, kRequest.data(), kRequest.size(), 0) != static_cast<ssize_t>(kRequest.size())) {
+        puts("send failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void report(const char *name, int count, size_t calls, double seconds) {
+    printf("%-10s %d requests of %zu bytes: %6zu recv() calls, %6.2f per request, %.2f us per request\n", name, count,
+           kRequest.size(), calls, double(calls) / count, seconds * 1e6 / count);
+}
+
+int main() {
+    const int count = 1000;
+
+    int sockets[2], bytewiseSockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, bytewiseSockets) < 0) {
+        puts("socketpair failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // The library logs every request it parses
+    std::cout.setstate(std::ios::failbit);
+
+    // Before: the request line and every header line are read until the empty line
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < count; i++) {
+        // The next request only arrives once the previous one was read
+        sendRequest(bytewiseSockets[0]);
+
+        if (receiveLineBytewise(bytewiseSockets[1]).rfind("GET /gamepad/battery ", 0) != 0) {
+            puts("Request wasn't read");
+            exit(EXIT_FAILURE);
+        }
+
+        while (!receiveLineBytewise(bytewiseSockets[1]).empty())
+            ;
+    }
+
+    double bytewiseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t bytewiseCalls   = gReceiveCalls;
+
+    close(bytewiseSockets[0]);
+    close(bytewiseSockets[1]);
+
+    // Now
+    auto stream = std::make_shared<TCPClientStream>(sockets[1]);
+    HttpRequest request;
+
+    gReceiveCalls = 0;
+    start         = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < count; i++) {
+        sendRequest(sockets[0]);
+
+        if (!request.parse(stream) || request.getPath() != "/gamepad/battery") {
+            puts("Request wasn't parsed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // The client hangs up, which takes one more call to notice
+    close(sockets[0]);
+
+    try {
+        request.parse(stream);
+    } catch (std::runtime_error &) {
+    }
+
+    report("per byte", count, bytewiseCalls, bytewiseSeconds);
+    report("buffered", count, gReceiveCalls, seconds);
+
+    return 0;
+}
@@ -19,4 +19,7 @@ done
 
 cd ..
 
-g++ -g -ggdb -std=c++17 ../../http.cpp demo.cpp ../MiniJson/Source/libJson.a -Itemplates -I../../htcc -I../.. -I ../MiniJson/Source/include -pthread -o tinyhttp_demo
+# static/ is compiled into the binary, see serveAssets() in demo.cpp
+../../htpack/htpack static static_assets staticAssets
+
+g++ -g -ggdb -std=c++23 ../../http.cpp demo.cpp static_assets.cpp ../MiniJson/Source/libJson.a -Itemplates -I../../htcc -I../.. -I ../MiniJson/Source/include -pthread -o tinyhttp_demo
@@ -1,5 +1,6 @@
 
 #include "http.hpp"
+#include "static_assets.hpp"
 #include <view.html.hpp>
 
 static std::vector<std::string> messages;
@@ -11,7 +12,7 @@ int main(int argc, char const *argv[])
     messages.push_back("Test message");
 
     s.when("/")->serveFile("index.html");
-    s.whenMatching("/static/[^/]+")->serveFromFolder("static");
+    s.serveAssets("/static", staticAssets);
 
     s.when("/messages")
         ->posted([](const HttpRequest& req) {
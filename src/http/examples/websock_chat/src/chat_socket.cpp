@@ -1,7 +1,8 @@
 
 #include "websock_chat.h"
 
-std::set<ChatSocketHandler*> gChatClients;
+// Every signed in client, a message is framed once for all of them
+static WebsockTopic gChatRoom;
 
 void ChatSocketHandler::onConnect() {
     puts("Connect!");
@@ -10,7 +11,7 @@ void ChatSocketHandler::onConnect() {
     
     if (checkSession()) {
         mUser = &gUsers[gUserSessions[mSessionToken]];
-        gChatClients.insert(this);
+        gChatRoom.subscribe(*this);
     }
 }
 
@@ -76,9 +77,7 @@ void ChatSocketHandler::onTextMessage(const std::string& message) {
         { "time", (double) now }
     };
 
-    for (auto client : gChatClients)
-        if (client != this)
-            client->sendJson(toSend);
+    gChatRoom.publishText(miniJson::Json(toSend).serialize(), this);
 }
 
 void ChatSocketHandler::onBinaryMessage(const std::vector<uint8_t>& data) {
@@ -87,7 +86,7 @@ void ChatSocketHandler::onBinaryMessage(const std::vector<uint8_t>& data) {
 
 void ChatSocketHandler::onDisconnect() {
     puts("Disconnect!");
-    gChatClients.erase(this);
+    gChatRoom.unsubscribe(*this);
 }
 
 bool ChatSocketHandler::checkSession() {
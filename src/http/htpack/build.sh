@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -O3 -Wall -std=c++20 main.cpp -lz -o htpack
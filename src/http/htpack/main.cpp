@@ -0,0 +1,200 @@
+// Packs a directory of static assets into a C++ translation unit for HttpServer::serveAssets().
+// Every file is stored as complete HTTP responses: as it is, gzipped when that is smaller,
+// and a 304 for conditional requests. All of them carry an ETag made from the content
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "../mimetypes.h"
+
+namespace fs = std::filesystem;
+
+struct Asset {
+    std::string path, content;
+};
+
+static std::string gzipCompress(const std::string &data) {
+    z_stream zs{};
+
+    // 16 added to the window bits asks for a gzip header instead of a zlib one
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        puts("deflateInit2 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    std::string out(deflateBound(&zs, data.size()), '\0');
+
+    zs.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in  = data.size();
+    zs.next_out  = reinterpret_cast<Bytef *>(out.data());
+    zs.avail_out = out.size();
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        puts("deflate failed");
+        exit(EXIT_FAILURE);
+    }
+
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    return out;
+}
+
+// FNV-1a, only has to change when the content does
+static std::string contentETag(const std::string &data) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (unsigned char ch : data) {
+        hash ^= ch;
+        hash *= 1099511628211ull;
+    }
+
+    char etag[24];
+    snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(hash));
+    return etag;
+}
+
+// Same layout as HttpResponse::writeHead()
+static std::string buildResponse(unsigned status, const std::string &etag, std::string_view type, const std::string *body, const char *encoding) {
+    std::string res = "HTTP/1.1 " + std::to_string(status) + "\r\nServer: tinyHTTP_1.1\r\n";
+
+    if (body) {
+        res += "Content-Length: " + std::to_string(body->size()) + "\r\n";
+        res += "Content-Type: " + std::string{type} + "\r\n";
+    }
+
+    if (encoding)
+        res += "Content-Encoding: " + std::string{encoding} + "\r\n";
+
+    res += "ETag: " + etag + "\r\nCache-Control: no-cache\r\nVary: Accept-Encoding\r\n\r\n";
+
+    if (body)
+        res += *body;
+
+    return res;
+}
+
+static void writeArray(std::ostream &out, const std::string &name, const std::string &data) {
+    out << "const unsigned char " << name << "[] = {";
+
+    for (size_t i = 0; i < data.size(); i++) {
+        char byte[8];
+        snprintf(byte, sizeof(byte), "0x%02x,", static_cast<unsigned char>(data[i]));
+        out << (i % 16 == 0 ? "\n        " : " ") << byte;
+    }
+
+    out << "\n};\n\n";
+}
+
+static std::string escapeString(const std::string &str) {
+    std::string res;
+
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\')
+            res += '\\';
+        res += ch;
+    }
+
+    return res;
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc != 4) {
+        puts("Usage: htpack <asset directory> <output name> <bundle name>");
+        puts("Writes <output name>.cpp and <output name>.hpp declaring the bundle");
+        exit(EXIT_FAILURE);
+    }
+
+    fs::path root{argv[1]};
+    std::string outName{argv[2]}, bundleName{argv[3]};
+
+    if (!fs::is_directory(root)) {
+        puts("Input is not a directory");
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<Asset> assets;
+
+    for (auto &entry : fs::recursive_directory_iterator(root)) {
+        if (!entry.is_regular_file())
+            continue;
+
+        std::ifstream in(entry.path(), std::ios::binary);
+        if (!in.is_open()) {
+            perror("Could not open asset");
+            exit(EXIT_FAILURE);
+        }
+
+        assets.push_back({fs::relative(entry.path(), root).generic_string(),
+                          std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>())});
+    }
+
+    if (assets.empty()) {
+        puts("No assets found");
+        exit(EXIT_FAILURE);
+    }
+
+    // Same output for the same input, no matter the directory order
+    std::sort(assets.begin(), assets.end(), [](const Asset &a, const Asset &b) { return a.path < b.path; });
+
+    std::ofstream header(outName + ".hpp");
+    std::ofstream source(outName + ".cpp");
+
+    if (!header.is_open() || !source.is_open()) {
+        perror("Could not open output file");
+        exit(EXIT_FAILURE);
+    }
+
+    std::string guard = "_HTPACK_" + bundleName + "_HPP";
+
+    header << "// Generated by htpack, don't edit\n\n"
+           << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+           << "#include \"http.hpp\"\n\n"
+           << "extern const std::span<const HttpAsset> " << bundleName << ";\n\n"
+           << "#endif\n";
+
+    source << "// Generated by htpack from " << root.generic_string() << ", don't edit\n\n"
+           << "#include \"" << fs::path{outName}.filename().generic_string() << ".hpp\"\n\n"
+           << "namespace {\n\n";
+
+    std::string table;
+
+    for (size_t i = 0; i < assets.size(); i++) {
+        const Asset &asset    = assets[i];
+        std::string etag      = contentETag(asset.content);
+        std::string_view type = lookupMimeType(asset.path);
+        std::string gzipped   = gzipCompress(asset.content);
+        std::string name      = "kAsset" + std::to_string(i);
+
+        writeArray(source, name, buildResponse(200, etag, type, &asset.content, nullptr));
+        writeArray(source, name + "NotModified", buildResponse(304, etag, type, nullptr, nullptr));
+
+        bool useGzip = gzipped.size() < asset.content.size();
+        if (useGzip)
+            writeArray(source, name + "Gzip", buildResponse(200, etag, type, &gzipped, "gzip"));
+
+        table += "        {\"" + escapeString(asset.path) + "\", \"" + escapeString(etag) + "\", {" + name + ", sizeof(" + name + ")}, ";
+        table += useGzip ? "{" + name + "Gzip, sizeof(" + name + "Gzip)}, " : "{nullptr, 0}, ";
+        table += "{" + name + "NotModified, sizeof(" + name + "NotModified)}},\n";
+
+        std::cout << asset.path << ": " << asset.content.size() << " bytes";
+        if (useGzip)
+            std::cout << ", " << gzipped.size() << " gzipped";
+        std::cout << std::endl;
+    }
+
+    source << "const HttpAsset kAssets[] = {\n"
+           << table << "};\n\n"
+           << "} // namespace\n\n"
+           << "const std::span<const HttpAsset> " << bundleName << "{kAssets};\n";
+
+    return 0;
+}
@@ -1,345 +1,3311 @@
 
 #include "http.hpp"
-
+#include "mimetypes.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <ctime>
 #include <iterator>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <vector>
 
-/*static*/ TCPClientStream TCPClientStream::acceptFrom(short listener) {
-    struct sockaddr_in client;
-    const size_t clientLen = sizeof(client);
+#ifdef TINYHTTP_GATHER_IO
+#include <sys/uio.h>
+#endif
+
+#ifdef TINYHTTP_COMPRESSION
+#include <zlib.h>
+#endif
+
+#ifdef TINYHTTP_REACTOR
+#include <atomic>
+#endif
+
+/*static*/ TCPClientStream TCPClientStream::acceptFrom(int listener) {
+    struct sockaddr_in client;
+    socklen_t clientLen = sizeof(client);
+
+    int sock = accept(listener, reinterpret_cast<struct sockaddr *>(&client), &clientLen);
+
+    return {sock < 0 ? -1 : sock};
+}
+
+#ifdef TINYHTTP_THREADING
+// A loopback UDP socket connected to itself, a byte sent to it wakes up whoever polls it. -1 if it failed
+static int openWakeSocket() {
+    struct sockaddr_in addr = {};
+    socklen_t addrLen       = sizeof(addr);
+
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock >= 0 &&
+        (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+         getsockname(sock, reinterpret_cast<struct sockaddr *>(&addr), &addrLen) < 0 ||
+         connect(sock, reinterpret_cast<struct sockaddr *>(&addr), addrLen) < 0)) {
+        ::close(sock);
+        sock = -1;
+    }
+
+    return sock;
+}
+#endif
+
+void TCPClientStream::send(const void *what, size_t size) {
+    SendSlice slice{what, size};
+    send(&slice, 1);
+}
+
+void TCPClientStream::send(const SendSlice *slices, size_t count) {
+    bool wasEmpty;
+
+    {
+#ifdef TINYHTTP_THREADING
+        std::lock_guard lock{mSendMutex};
+#endif
+
+        // Queued output goes first, new output is only written directly once nothing is waiting
+        wasEmpty = flushLocked();
+        appendLocked(slices, count, wasEmpty);
+
+        if (mOutputSize == 0)
+            return;
+    }
+
+    // Nobody waits for the socket to become writable, so the rest is sent right here
+    if (mOutputWatcher && (!wasEmpty || mOutputWatcher()))
+        return;
+
+    drainOutput(0);
+}
+
+bool TCPClientStream::queue(const SendSlice *slices, size_t count, size_t limit) {
+    bool wasEmpty;
+
+    {
+#ifdef TINYHTTP_THREADING
+        std::lock_guard lock{mSendMutex};
+#endif
+
+        wasEmpty = flushLocked();
+        if (mOutputSize > limit)
+            return false;
+
+        appendLocked(slices, count, wasEmpty);
+
+        if (mOutputSize == 0)
+            return true;
+    }
+
+    if (mOutputWatcher && (!wasEmpty || mOutputWatcher()))
+        return true;
+
+#ifdef TINYHTTP_THREADING
+    // Once output waits, the reader flushes it until it's gone, it only has to be woken for the first
+    if (mWakeSocket >= 0) {
+        if (wasEmpty) {
+            char ch = 0;
+            ::send(mWakeSocket, &ch, 1, MSG_NOSIGNAL);
+        }
+
+        return true;
+    }
+#endif
+
+    drainOutput(0);
+    return true;
+}
+
+void TCPClientStream::appendLocked(const SendSlice *slices, size_t count, bool write) {
+    size_t sent = write ? writeSome(slices, count) : 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t skip = std::min(sent, slices[i].size);
+        sent -= skip;
+
+        if (skip == slices[i].size)
+            continue;
+
+        const uint8_t *data = static_cast<const uint8_t *>(slices[i].data) + skip;
+        size_t size         = slices[i].size - skip;
+        mOutputSize += size;
+
+        if (slices[i].owner) {
+            mOutput.push_back({slices[i].owner, data, size, {}});
+            continue;
+        }
+
+        // Copies are collected in the last entry while they follow each other, like the heads of a batch
+        if (mOutput.size() == mOutputFirst || mOutput.back().owner)
+            mOutput.emplace_back();
+
+        OutputEntry &entry = mOutput.back();
+        entry.copy.insert(entry.copy.end(), data, data + size);
+        entry.data = entry.copy.data();
+        entry.size = entry.copy.size();
+    }
+}
+
+size_t TCPClientStream::writeSome(const SendSlice *slices, size_t count) {
+#ifdef MSG_DONTWAIT
+    const int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#else
+    const int flags = MSG_NOSIGNAL;
+#endif
+
+    // A full socket buffer isn't an error, the caller queues whatever is left
+    auto check = [](ssize_t sent) -> size_t {
+        if (sent >= 0)
+            return static_cast<size_t>(sent);
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+
+        throw std::runtime_error("TCP send failed");
+    };
+
+    size_t total = 0;
+
+#ifdef TINYHTTP_GATHER_IO
+    struct iovec iov[8];
+    struct msghdr msg = {};
+
+    while (count > 0) {
+        size_t n = std::min(count, std::size(iov)), size = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            iov[i] = {const_cast<void *>(slices[i].data), slices[i].size};
+            size += slices[i].size;
+        }
+
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = n;
+
+        size_t sent = check(::sendmsg(mSocket, &msg, flags));
+        total += sent;
+
+        if (sent < size)
+            break;
+
+        slices += n;
+        count -= n;
+    }
+#else
+    for (size_t i = 0; i < count; i++)
+        total += slices[i].size;
+
+    // Without gather I/O small messages are joined on the stack, so they still leave in one segment
+    if (total <= TINYHTTP_SEND_COALESCE_SIZE) {
+        uint8_t buffer[TINYHTTP_SEND_COALESCE_SIZE];
+        size_t len = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            memcpy(buffer + len, slices[i].data, slices[i].size);
+            len += slices[i].size;
+        }
+
+        return len > 0 ? check(::send(mSocket, buffer, len, flags)) : 0;
+    }
+
+    total = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t sent = slices[i].size > 0 ? check(::send(mSocket, slices[i].data, slices[i].size, flags)) : 0;
+        total += sent;
+
+        if (sent < slices[i].size)
+            break;
+    }
+#endif
+
+    return total;
+}
+
+bool TCPClientStream::flushLocked() {
+    while (mOutputFirst < mOutput.size()) {
+        SendSlice slices[8];
+        size_t count = 0, size = 0;
+
+        for (size_t i = mOutputFirst; i < mOutput.size() && count < std::size(slices); i++, count++) {
+            size_t skip   = i == mOutputFirst ? mOutputPos : 0;
+            slices[count] = {static_cast<const uint8_t *>(mOutput[i].data) + skip, mOutput[i].size - skip};
+            size += slices[count].size;
+        }
+
+        size_t sent = writeSome(slices, count);
+        mOutputSize -= sent;
+        mOutputPos += sent;
+
+        // Entries that went out let go of their owner or copy right away
+        while (mOutputFirst < mOutput.size() && mOutputPos >= mOutput[mOutputFirst].size) {
+            mOutputPos -= mOutput[mOutputFirst].size;
+            mOutput[mOutputFirst++] = {};
+        }
+
+        if (sent < size)
+            break;
+    }
+
+    if (mOutputFirst < mOutput.size()) {
+        // Only moved once most of them went out, so every entry is moved about once
+        if (mOutputFirst > mOutput.size() / 2) {
+            mOutput.erase(mOutput.begin(), mOutput.begin() + mOutputFirst);
+            mOutputFirst = 0;
+        }
+
+        return false;
+    }
+
+    // A long queue shouldn't keep its memory for the rest of the connection
+    if (mOutput.capacity() * sizeof(OutputEntry) > TINYHTTP_OUTPUT_HIGH_WATERMARK)
+        std::vector<OutputEntry>{}.swap(mOutput);
+    else
+        mOutput.clear();
+
+    mOutputFirst = mOutputPos = 0;
+    return true;
+}
+
+size_t TCPClientStream::pendingOutput() const noexcept {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mSendMutex};
+#endif
+    return mOutputSize;
+}
+
+bool TCPClientStream::flushOutput() {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mSendMutex};
+#endif
+    return flushLocked();
+}
+
+void TCPClientStream::drainOutput(size_t limit) {
+    while (true) {
+        int sock;
+
+        {
+#ifdef TINYHTTP_THREADING
+            std::lock_guard lock{mSendMutex};
+#endif
+            flushLocked();
+
+            if (mOutputSize <= limit)
+                return;
+
+            sock = mSocket;
+        }
+
+        // Not locked while waiting, other senders only append to the queue
+        struct pollfd fd = {sock, POLLOUT, 0};
+        int ready        = poll(&fd, 1, TINYHTTP_SEND_TIMEOUT > 0 ? TINYHTTP_SEND_TIMEOUT * 1000 : -1);
+
+        if (ready == 0)
+            throw std::runtime_error("TCP send timed out");
+
+        if (ready < 0 && errno != EINTR)
+            throw std::runtime_error("TCP send failed");
+    }
+}
+
+void TCPClientStream::setNoDelay(bool enabled) {
+#ifdef TCP_NODELAY
+    if (mSocket < 0 || mNoDelay == static_cast<int>(enabled))
+        return;
+
+    int opt = enabled;
+    if (setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == 0)
+        mNoDelay = enabled;
+#endif
+}
+
+bool TCPClientStream::hasBufferedHead() const noexcept {
+    const char *begin = mReadBuffer.get() + mReadPos;
+    const char *end   = mReadBuffer.get() + mReadEnd;
+
+    // Same terminators as receiveHead(): an empty line ending with either CRLF or LF
+    for (const char *p = begin; p < end;) {
+        auto nl = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!nl)
+            return false;
+
+        if ((nl + 1 < end && nl[1] == '\n') || (nl + 2 < end && nl[1] == '\r' && nl[2] == '\n'))
+            return true;
+
+        p = nl + 1;
+    }
+
+    return false;
+}
+
+void TCPClientStream::makeReadRoom() {
+    if (!mReadBuffer)
+        mReadBuffer.reset(new char[TINYHTTP_READ_BUFFER_SIZE]);
+
+    if (mReadPos == mReadEnd) {
+        mReadPos = mReadEnd = 0;
+    } else if (mReadEnd == TINYHTTP_READ_BUFFER_SIZE && mReadPos > 0) {
+        // Make room for the rest of a partially received line or head
+        memmove(mReadBuffer.get(), mReadBuffer.get() + mReadPos, mReadEnd - mReadPos);
+        mReadEnd -= mReadPos;
+        mReadPos = 0;
+    }
+}
+
+size_t TCPClientStream::fillReadBuffer() {
+    makeReadRoom();
+
+    ssize_t len;
+    waitReadable();
+
+    if ((len = recv(mSocket, mReadBuffer.get() + mReadEnd, TINYHTTP_READ_BUFFER_SIZE - mReadEnd, MSG_NOSIGNAL)) < 0)
+        throw std::runtime_error("TCP receive failed");
+
+    mReadEnd += static_cast<size_t>(len);
+    return static_cast<size_t>(len);
+}
+
+// Without an output watcher, what other threads queued is sent from here while waiting for input
+void TCPClientStream::waitReadable() {
+#ifdef TINYHTTP_THREADING
+    while (mWakeSocket >= 0 && mSocket >= 0) {
+        bool waiting;
+
+        {
+            std::lock_guard lock{mSendMutex};
+            waiting = !flushLocked();
+        }
+
+        struct pollfd fds[2] = {{mSocket, static_cast<short>(waiting ? POLLIN | POLLOUT : POLLIN), 0}, {mWakeSocket, POLLIN, 0}};
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw std::runtime_error("TCP receive failed");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[16];
+            recv(mWakeSocket, drain, sizeof(drain), MSG_NOSIGNAL);
+        }
+
+        // Readable, closed or failed, recv() tells which
+        if (fds[0].revents & ~POLLOUT)
+            return;
+    }
+#endif
+}
+
+size_t TCPClientStream::receive(void *target, size_t max) {
+    if (mReadPos == mReadEnd) {
+        // Large reads skip the buffer, there is nothing to gain from copying them twice
+        if (max >= TINYHTTP_READ_BUFFER_SIZE) {
+            ssize_t len;
+            waitReadable();
+
+            if ((len = recv(mSocket, target, max, MSG_NOSIGNAL)) < 0)
+                throw std::runtime_error("TCP receive failed");
+
+            return static_cast<size_t>(len);
+        }
+
+        if (fillReadBuffer() == 0)
+            return 0;
+    }
+
+    size_t len = std::min(max, mReadEnd - mReadPos);
+    memcpy(target, mReadBuffer.get() + mReadPos, len);
+    mReadPos += len;
+
+    return len;
+}
+
+size_t TCPClientStream::receiveNow(void *target, size_t max) {
+    if (max == 0)
+        return 0;
+
+#ifdef MSG_DONTWAIT
+    const int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#else
+    // Only read once poll() tells it won't wait
+    const int flags  = MSG_NOSIGNAL;
+    struct pollfd fd = {mSocket, POLLIN, 0};
+    if (poll(&fd, 1, 0) == 0)
+        return 0;
+#endif
+
+    ssize_t len = recv(mSocket, target, max, flags);
+    if (len > 0)
+        return static_cast<size_t>(len);
+
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+
+    throw std::runtime_error(len == 0 ? "TCP connection closed" : "TCP receive failed");
+}
+
+size_t TCPClientStream::receiveAvailable() {
+    makeReadRoom();
+
+    size_t len = receiveNow(mReadBuffer.get() + mReadEnd, TINYHTTP_READ_BUFFER_SIZE - mReadEnd);
+    mReadEnd += len;
+    return len;
+}
+
+size_t TCPClientStream::receiveAvailable(void *target, size_t max) {
+    if (mReadPos == mReadEnd)
+        return receiveNow(target, max);
+
+    size_t len = std::min(max, mReadEnd - mReadPos);
+    memcpy(target, mReadBuffer.get() + mReadPos, len);
+    mReadPos += len;
+
+    return len;
+}
+
+std::string TCPClientStream::receiveLine(bool asciiOnly, size_t max) {
+    std::string res;
+
+    while (res.size() < max) {
+        if (mReadPos == mReadEnd && fillReadBuffer() == 0)
+            throw std::runtime_error("TCP receive failed");
+
+        const char *start = mReadBuffer.get() + mReadPos;
+        size_t len        = std::min(mReadEnd - mReadPos, max - res.size());
+        const char *end   = static_cast<const char *>(memchr(start, '\n', len));
+        bool foundEnd     = end != nullptr;
+
+        if (!foundEnd)
+            end = start + len;
+
+        for (const char *it = start; it != end; ++it) {
+            if (*it == '\r') continue;
+
+            if (asciiOnly && !isascii(*it))
+                throw std::runtime_error("Only ASCII characters were allowed");
+
+            res.push_back(*it);
+        }
+
+        mReadPos += (end - start) + (foundEnd ? 1 : 0);
+
+        if (foundEnd) break;
+    }
+
+    return res;
+}
+
+std::string_view TCPClientStream::receiveHead(size_t max) {
+    max = std::min<size_t>(max, TINYHTTP_READ_BUFFER_SIZE);
+
+    // Position up to which the buffered data was already searched for the end of the head
+    size_t scanned = mReadPos;
+
+    while (true) {
+        const char *buffer = mReadBuffer.get();
+
+        for (const char *it; scanned < mReadEnd; scanned = (it - buffer) + 1) {
+            if (!(it = static_cast<const char *>(memchr(buffer + scanned, '\n', mReadEnd - scanned)))) {
+                scanned = mReadEnd;
+                break;
+            }
+
+            size_t lineStart = (it - buffer) + 1;
+
+            if (lineStart == mReadEnd || (lineStart + 1 == mReadEnd && buffer[lineStart] == '\r')) {
+                // Can't tell yet whether the next line is empty, look at this one again after reading more
+                scanned = it - buffer;
+                break;
+            }
+
+            // The head ends with an empty line, some clients leave out the CR
+            if (buffer[lineStart] == '\n' || (buffer[lineStart] == '\r' && buffer[lineStart + 1] == '\n')) {
+                size_t end = lineStart + (buffer[lineStart] == '\r' ? 2 : 1);
+                std::string_view head{buffer + mReadPos, end - mReadPos};
+                mReadPos = end;
+                return head;
+            }
+        }
+
+        if (mReadEnd - mReadPos >= max)
+            throw std::runtime_error("request head too large");
+
+        size_t consumed = mReadPos;
+
+        if (fillReadBuffer() == 0)
+            throw std::runtime_error("TCP receive failed");
+
+        // Filling may have moved the unread data to the front of the buffer
+        scanned -= consumed - mReadPos;
+    }
+}
+
+void TCPClientStream::flushOutputOnRead() {
+#ifdef TINYHTTP_THREADING
+    if (mOutputWatcher || mWakeSocket >= 0)
+        return;
+
+    // Stays unset if it can't be made, queue() waits like send() then
+    mWakeSocket = openWakeSocket();
+#endif
+}
+
+void TCPClientStream::close() {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mSendMutex};
+#endif
+
+    if (mSocket < 0) return;
+    ::shutdown(mSocket, SHUT_RDWR);
+    ::close(mSocket);
+    mSocket = -1;
+}
+
+static HttpRequestMethod parseRequestMethod(std::string_view name) noexcept {
+    switch (name.empty() ? '\0' : name[0]) {
+        case 'G':
+            if (name == "GET") return HttpRequestMethod::GET;
+            break;
+        case 'P':
+            if (name == "POST") return HttpRequestMethod::POST;
+            if (name == "PUT") return HttpRequestMethod::PUT;
+            break;
+        case 'D':
+            if (name == "DELETE") return HttpRequestMethod::DELETE;
+            break;
+        case 'O':
+            if (name == "OPTIONS") return HttpRequestMethod::OPTIONS;
+            break;
+    }
+
+    return HttpRequestMethod::UNKNOWN;
+}
+
+static inline bool isHeadWhitespace(char ch) noexcept {
+    return ch == ' ' || ch == '\t';
+}
+
+// Indexed by HttpHeader
+static constexpr std::string_view kHttpHeaderNames[] = {
+        "",
+        "Accept-Encoding",
+        "Accept-Ranges",
+        "Connection",
+        "Content-Encoding",
+        "Content-Length",
+        "Content-Range",
+        "Content-Type",
+        "ETag",
+        "Host",
+        "If-Modified-Since",
+        "If-None-Match",
+        "If-Range",
+        "Last-Modified",
+        "Range",
+        "Sec-WebSocket-Accept",
+        "Sec-WebSocket-Extensions",
+        "Sec-WebSocket-Key",
+        "Server",
+        "Transfer-Encoding",
+        "Upgrade",
+        "Vary",
+};
+
+static_assert(std::size(kHttpHeaderNames) == static_cast<size_t>(HttpHeader::VARY) + 1, "kHttpHeaderNames is out of sync with HttpHeader");
+
+static constexpr auto kHttpHeaderHashes = []() {
+    std::array<uint32_t, std::size(kHttpHeaderNames)> hashes{};
+
+    for (size_t i = 0; i < hashes.size(); i++)
+        hashes[i] = hashHttpHeaderName(kHttpHeaderNames[i]);
+
+    return hashes;
+}();
+
+HttpHeader identifyHttpHeader(std::string_view name, uint32_t hash) noexcept {
+    for (size_t i = 1; i < kHttpHeaderHashes.size(); i++)
+        if (kHttpHeaderHashes[i] == hash && equalsHttpHeaderName(kHttpHeaderNames[i], name))
+            return static_cast<HttpHeader>(i);
+
+    return HttpHeader::OTHER;
+}
+
+std::string_view httpHeaderName(HttpHeader id) noexcept {
+    return kHttpHeaderNames[static_cast<size_t>(id)];
+}
+
+bool acceptsHttpEncoding(std::string_view acceptEncoding, std::string_view coding) noexcept {
+    bool wildcard = false;
+
+    while (!acceptEncoding.empty()) {
+        size_t comma          = acceptEncoding.find(',');
+        std::string_view item = acceptEncoding.substr(0, comma);
+        acceptEncoding        = comma == std::string_view::npos ? std::string_view{} : acceptEncoding.substr(comma + 1);
+
+        std::string_view name = item.substr(0, item.find(';'));
+        while (!name.empty() && isHeadWhitespace(name.front())) name.remove_prefix(1);
+        while (!name.empty() && isHeadWhitespace(name.back())) name.remove_suffix(1);
+
+        // Only a zero weight matters here, any other one allows the coding
+        bool refused = false;
+        if (size_t q = item.find("q="); q != std::string_view::npos) {
+            std::string_view weight = item.substr(q + 2);
+            refused                 = !weight.empty() && weight.front() == '0' && weight.find_first_not_of("0.", 1) == std::string_view::npos;
+        }
+
+        if (equalsHttpHeaderName(name, coding))
+            return !refused;
+
+        if (name == "*")
+            wildcard = !refused;
+    }
+
+    return wildcard;
+}
+
+ContentCoding negotiateContentCoding(std::string_view acceptEncoding) noexcept {
+#ifdef TINYHTTP_COMPRESSION
+    if (acceptsHttpEncoding(acceptEncoding, "gzip"))
+        return ContentCoding::GZIP;
+
+    if (acceptsHttpEncoding(acceptEncoding, "deflate"))
+        return ContentCoding::DEFLATE;
+#endif
+
+    return ContentCoding::IDENTITY;
+}
+
+bool HttpRequest::parseHead() {
+    const char *begin = mHead.data();
+    const char *end   = begin + mHead.size();
+    const char *it    = begin;
+
+    auto makeSlice = [begin](const char *from, const char *to) {
+        return HeadSlice{static_cast<uint32_t>(from - begin), static_cast<uint32_t>(to - from)};
+    };
+
+    // Request line: <method> <target> [version]
+    const char *lineEnd = static_cast<const char *>(memchr(it, '\n', end - it));
+    if (!lineEnd)
+        return false;
+
+    const char *methodEnd = it;
+    while (methodEnd != lineEnd && !isHeadWhitespace(*methodEnd) && *methodEnd != '\r') ++methodEnd;
+
+    std::string_view methodName{it, static_cast<size_t>(methodEnd - it)};
+    if ((mMethod = parseRequestMethod(methodName)) == HttpRequestMethod::UNKNOWN)
+        return false;
+
+    const char *target = methodEnd;
+    while (target != lineEnd && isHeadWhitespace(*target)) ++target;
+
+    const char *targetEnd = target;
+    while (targetEnd != lineEnd && !isHeadWhitespace(*targetEnd) && *targetEnd != '\r') ++targetEnd;
+
+    if (target == targetEnd)
+        return false;
+
+    const char *question = static_cast<const char *>(memchr(target, '?', targetEnd - target));
+    mPath                = makeSlice(target, question ? question : targetEnd);
+    mQuery               = question ? makeSlice(question, targetEnd) : HeadSlice{};
+
+    if (mQuery.length == 0)
+        std::cout << methodName << " " << getPath() << std::endl;
+    else
+        std::cout << methodName << " " << getPath() << " (Query: " << getQuery() << ")" << std::endl;
+
+    // Headers: <key>: <value>, up to the empty line
+    for (it = lineEnd + 1; it < end; it = lineEnd + 1) {
+        lineEnd = static_cast<const char *>(memchr(it, '\n', end - it));
+        if (!lineEnd)
+            return false;
+
+        const char *contentEnd = (lineEnd != it && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+        if (contentEnd == it)
+            break;
+
+        const char *sep = static_cast<const char *>(memchr(it, ':', contentEnd - it));
+        if (!sep || sep == it)
+            return false;
+
+        if (mHeaderCount >= MAX_HTTP_HEADERS)
+            return false;
+
+        const char *value = sep + 1, *valueEnd = contentEnd;
+        while (value != valueEnd && isHeadWhitespace(*value)) ++value;
+        while (valueEnd != value && isHeadWhitespace(valueEnd[-1])) --valueEnd;
+
+        std::string_view name{it, static_cast<size_t>(sep - it)};
+        uint32_t hash = hashHttpHeaderName(name);
+
+        mHeaderFields[mHeaderCount++] = {hash, identifyHttpHeader(name, hash), makeSlice(it, sep), makeSlice(value, valueEnd)};
+    }
+
+    return true;
+}
+
+std::string_view HttpRequest::header(std::string_view name) const noexcept {
+    uint32_t hash = hashHttpHeaderName(name);
+
+    // Search from the back, so a repeated header overrides the earlier ones
+    for (size_t i = mHeaderCount; i-- > 0;)
+        if (mHeaderFields[i].hash == hash && equalsHttpHeaderName(slice(mHeaderFields[i].name), name))
+            return slice(mHeaderFields[i].value);
+
+    return {};
+}
+
+std::string_view HttpRequest::header(HttpHeader id) const noexcept {
+    for (size_t i = mHeaderCount; i-- > 0;)
+        if (mHeaderFields[i].id == id)
+            return slice(mHeaderFields[i].value);
+
+    return {};
+}
+
+std::string_view HttpRequest::param(std::string_view name) const noexcept {
+    for (auto &p : mParams)
+        if (p.name == name)
+            return getPath().substr(p.offset, p.length);
+
+    return {};
+}
+
+bool HttpRequest::parse(std::shared_ptr<IClientStream> stream) {
+    if (!receiveHead(*stream))
+        return false;
+
+    receiveContent();
+    return true;
+}
+
+bool HttpRequest::receiveHead(IClientStream &stream) {
+    mMethod      = HttpRequestMethod::UNKNOWN;
+    mPath        = mQuery = {};
+    mHeaderCount = 0;
+    mParams.clear();
+    mContent.clear();
+
+#ifdef TINYHTTP_JSON
+    mContentJson = miniJson::Json{};
+#endif
+
+    mContentStream   = &stream;
+    mContentReceived = false;
+    mContentDone     = true;
+
+    mHead.assign(stream.receiveHead(MAX_HTTP_HEAD_SIZE));
+
+#ifdef TINYHTTP_TRACING
+    mTrace       = {};
+    mTrace.start = std::chrono::steady_clock::now();
+#endif
+
+    for (char ch : mHead)
+        if (!isascii(ch))
+            throw std::runtime_error("Only ASCII characters were allowed");
+
+    bool valid = parseHead() && parseContentFraming();
+
+#ifdef TINYHTTP_TRACING
+    std::string_view path = getPath().substr(0, sizeof(mTrace.path));
+    std::copy(path.begin(), path.end(), mTrace.path);
+    mTrace.pathLength = static_cast<uint8_t>(path.size());
+    mTrace.method     = mMethod;
+    mTrace.add(HttpTrace::HEAD, mTrace.start);
+#endif
+
+    return valid;
+}
+
+bool HttpRequest::parseContentFraming() {
+    mContentLeft    = mContentRead = 0;
+    mMaxContentSize = MAX_HTTP_CONTENT_SIZE;
+    mChunkStarted   = mContentFailed = false;
+
+    // Transfer-Encoding wins over Content-Length, only chunked is understood
+    std::string_view transferEncoding = header(HttpHeader::TRANSFER_ENCODING);
+    mChunked                          = !transferEncoding.empty();
+    if (mChunked && !equalsHttpHeaderName(transferEncoding, "chunked"))
+        return false;
+
+    std::string_view contentLength = header(HttpHeader::CONTENT_LENGTH);
+    if (!mChunked && !contentLength.empty()) {
+        auto [end, ec] = std::from_chars(contentLength.data(), contentLength.data() + contentLength.size(), mContentLeft);
+        if (ec != std::errc{} || end != contentLength.data() + contentLength.size())
+            return false;
+    }
+
+    mContentDone = !mChunked && mContentLeft == 0;
+    return true;
+}
+
+void HttpRequest::receiveContent(HttpContentPolicy policy) {
+    mContentReceived = true;
+    mMaxContentSize  = policy.maxSize;
+
+    try {
+        if (!mChunked && mContentLeft > mMaxContentSize)
+            throw HttpRequestError(413, "request too large");
+
+        if (policy.streamed)
+            return;
+
+#ifdef TINYHTTP_TRACING
+        auto bodyStart = std::chrono::steady_clock::now();
+#endif
+
+        while (size_t run = nextContentRun()) {
+            size_t start = mContent.size(), end = start + run;
+            std::exception_ptr error;
+
+            // The body goes straight into the string, resize_and_overwrite() doesn't clear the new part first
+            mContent.resize_and_overwrite(end, [&](char *data, size_t) {
+                size_t pos = start;
+
+                try {
+                    while (pos < end)
+                        pos += readContent(data + pos, end - pos);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                return pos;
+            });
+
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+#ifdef TINYHTTP_TRACING
+        mTrace.add(HttpTrace::BODY, bodyStart);
+#endif
+    } catch (...) {
+        mContentFailed = true;
+        throw;
+    }
+
+#ifdef TINYHTTP_JSON
+    std::string_view contentType = header(HttpHeader::CONTENT_TYPE);
+    if (!mContent.empty() && (contentType == "application/json" || contentType.starts_with("application/json;")) // some clients gives us extra data like charset
+    ) {
+#ifdef TINYHTTP_TRACING
+        auto jsonStart = std::chrono::steady_clock::now();
+#endif
+        std::string error;
+        mContentJson = miniJson::Json::parse(mContent, error);
+        if (!error.empty())
+            std::cerr << "Content type was JSON but we couldn't parse it! " << error << std::endl;
+#ifdef TINYHTTP_TRACING
+        mTrace.add(HttpTrace::JSON, jsonStart);
+#endif
+    }
+#endif
+}
+
+bool HttpRequest::bufferContent(size_t maxSize) {
+    // Chunk sizes can't be read without waiting, and a body over the limit is refused by receiveContent()
+    if (mContentDone || mChunked || mContentLeft > maxSize)
+        return true;
+
+    try {
+        while (mContentLeft > 0) {
+            size_t start = mContent.size(), len = 0;
+            std::exception_ptr error;
+
+            mContent.resize_and_overwrite(start + mContentLeft, [&](char *data, size_t) {
+                try {
+                    len = mContentStream->receiveAvailable(data + start, mContentLeft);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                return start + len;
+            });
+
+            if (error)
+                std::rethrow_exception(error);
+
+            if (len == 0)
+                return false;
+
+            mContentLeft -= len;
+            mContentRead += len;
+        }
+    } catch (...) {
+        mContentFailed = true;
+        throw;
+    }
+
+    mContentDone = true;
+    return true;
+}
+
+size_t HttpRequest::nextContentRun() const {
+    if (mContentFailed)
+        throw HttpRequestError(400, "request body was already broken");
+
+    if (mContentDone)
+        return 0;
+
+    if (mContentLeft > 0 || !mChunked)
+        return static_cast<size_t>(std::min<uint64_t>(mContentLeft, SIZE_MAX));
+
+    IClientStream &stream = *mContentStream;
+
+    // Chunk data is followed by a line break, the next chunk starts with its size in hex
+    if (mChunkStarted && !stream.receiveLine(true, 2).empty())
+        throw HttpRequestError(400, "malformed chunk");
+
+    std::string line = stream.receiveLine(true, 256);
+    uint64_t size    = 0;
+
+    auto [end, ec] = std::from_chars(line.data(), line.data() + line.size(), size, 16);
+    if (ec != std::errc{} || (end != line.data() + line.size() && *end != ';' && *end != ' ' && *end != '\t'))
+        throw HttpRequestError(400, "malformed chunk size");
+
+    if (size == 0) {
+        // Trailers aren't used for anything
+        for (size_t i = 0; !stream.receiveLine(true, MAX_HTTP_HEAD_SIZE).empty(); i++)
+            if (i >= MAX_HTTP_HEADERS)
+                throw HttpRequestError(400, "too many trailers");
+
+        mContentDone = true;
+        return 0;
+    }
+
+    if (size > mMaxContentSize - mContentRead)
+        throw HttpRequestError(413, "request too large");
+
+    mChunkStarted = true;
+    mContentLeft  = size;
+    return static_cast<size_t>(size);
+}
+
+size_t HttpRequest::readContent(void *target, size_t max) const {
+    try {
+        size_t run = nextContentRun();
+        if (run == 0 || max == 0)
+            return 0;
+
+        // The stream may hand out what it has buffered before reading the rest
+        size_t len = mContentStream->receive(target, std::min(run, max));
+        if (len == 0)
+            throw HttpRequestError(400, "unexpected end of request body");
+
+        mContentLeft -= len;
+        mContentRead += len;
+        mContentDone = !mChunked && mContentLeft == 0;
+        return len;
+    } catch (...) {
+        mContentFailed = true;
+        throw;
+    }
+}
+
+bool HttpRequest::discardContent() noexcept {
+    if (mContentDone)
+        return true;
+
+    // Anything larger is cheaper to drop together with the connection
+    if (mContentFailed || (!mChunked && mContentLeft > MAX_HTTP_CONTENT_SIZE))
+        return false;
+
+    try {
+        if (mContentBuffer.empty())
+            mContentBuffer.resize(TINYHTTP_READ_BUFFER_SIZE);
+
+        for (size_t skipped = 0; skipped <= MAX_HTTP_CONTENT_SIZE;) {
+            size_t len = readContent(mContentBuffer.data(), mContentBuffer.size());
+            if (len == 0)
+                return true;
+
+            skipped += len;
+        }
+    } catch (...) {
+    }
+
+    return false;
+}
+
+/*static*/ bool HttpHandlerBuilder::isSafeFilename(const std::string &name, bool allowSlash) {
+    static const char allowedChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-+@";
+    for (auto x : name) {
+        if (x == '/' && !allowSlash)
+            return false;
+
+        bool ok = false;
+        for (size_t i = 0; allowedChars[i] && !ok; i++)
+            ok = allowedChars[i] == x;
+
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+/*static*/ std::string_view HttpHandlerBuilder::getMimeType(std::string_view name) noexcept {
+    return lookupMimeType(name);
+}
+
+// Recently served files, up to TINYHTTP_FILE_CACHE_SIZE bytes of content. Every hit is checked
+// against stat(), which is much cheaper than reading the file, so changed files are read again
+class StaticFileCache {
+public:
+    struct File {
+        std::shared_ptr<const std::string> content;
+        time_t modified;
+        std::string etag, lastModified;
+    };
+
+    std::shared_ptr<const File> get(const std::string &path);
+
+private:
+    struct Entry {
+        std::string path;
+        std::shared_ptr<const File> file;
+    };
+
+    std::list<Entry> mEntries; // most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> mIndex;
+    size_t mSize = 0;
+
+#ifdef TINYHTTP_THREADING
+    std::mutex mMutex;
+#endif
+
+    static std::shared_ptr<const File> load(const std::string &path, const struct stat &st);
+};
+
+std::shared_ptr<const StaticFileCache::File> StaticFileCache::get(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return nullptr;
+
+    {
+#ifdef TINYHTTP_THREADING
+        std::lock_guard lock{mMutex};
+#endif
+
+        auto f = mIndex.find(path);
+        if (f != mIndex.end()) {
+            auto &file = f->second->file;
+            if (file->modified == st.st_mtime && file->content->size() == static_cast<size_t>(st.st_size)) {
+                mEntries.splice(mEntries.begin(), mEntries, f->second);
+                return file;
+            }
+        }
+    }
+
+    // Read without holding the lock, the storage is slow
+    auto file = load(path, st);
+    if (!file || file->content->size() > TINYHTTP_FILE_CACHE_SIZE / 4)
+        return file;
+
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mMutex};
+#endif
+
+    if (auto f = mIndex.find(path); f != mIndex.end()) {
+        mSize -= f->second->file->content->size();
+        mEntries.erase(f->second);
+        mIndex.erase(f);
+    }
+
+    mEntries.push_front({path, file});
+    mIndex.emplace(mEntries.front().path, mEntries.begin());
+    mSize += file->content->size();
+
+    while (mSize > TINYHTTP_FILE_CACHE_SIZE) {
+        auto &last = mEntries.back();
+        mSize -= last.file->content->size();
+        mIndex.erase(last.path);
+        mEntries.pop_back();
+    }
+
+    return file;
+}
+
+/*static*/ std::shared_ptr<const StaticFileCache::File> StaticFileCache::load(const std::string &path, const struct stat &st) {
+    std::ifstream t(path, std::ios::binary);
+    if (!t.is_open())
+        return nullptr;
+
+    // Read straight into the final string, without going through a stream iterator
+    std::string content;
+    content.resize_and_overwrite(st.st_size, [&t](char *data, size_t size) {
+        t.read(data, size);
+        return static_cast<size_t>(t.gcount());
+    });
+
+    auto file      = std::make_shared<File>();
+    file->content  = std::make_shared<const std::string>(std::move(content));
+    file->modified = st.st_mtime;
+
+    char etag[48];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"", static_cast<unsigned long long>(st.st_mtime), static_cast<unsigned long long>(st.st_size));
+    file->etag = etag;
+
+    char date[32];
+    struct tm tm;
+    gmtime_r(&file->modified, &tm);
+    file->lastModified.assign(date, strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm));
+
+    return file;
+}
+
+// Only the IMF-fixdate format ("Sun, 06 Nov 1994 08:49:37 GMT"), which is what clients send back
+static bool parseHttpDate(std::string_view date, time_t &out) noexcept {
+    static constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (date.size() != 29 || date.substr(25) != " GMT")
+        return false;
+
+    auto number = [date](size_t pos, size_t len, int &value) {
+        auto [end, ec] = std::from_chars(date.data() + pos, date.data() + pos + len, value);
+        return ec == std::errc{} && end == date.data() + pos + len;
+    };
+
+    int day, year, hour, minute, second;
+    size_t month = months.find(date.substr(8, 3));
+    if (month == std::string_view::npos || month % 3 != 0 || !number(5, 2, day) || !number(12, 4, year) ||
+        !number(17, 2, hour) || !number(20, 2, minute) || !number(23, 2, second))
+        return false;
+
+    // Days since 1970-01-01 of a proleptic Gregorian date, timegm() isn't available everywhere
+    unsigned m   = month / 3 + 1;
+    int y        = year - (m <= 2);
+    int era      = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = static_cast<unsigned>(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = static_cast<int64_t>(era) * 146097 + doe - 719468;
+
+    out = static_cast<time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+    return true;
+}
+
+// Weak comparison of an If-None-Match list against a tag
+static bool matchesETag(std::string_view list, std::string_view etag) noexcept {
+    while (!list.empty()) {
+        size_t comma          = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        list                  = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+
+        while (!item.empty() && isHeadWhitespace(item.front())) item.remove_prefix(1);
+        while (!item.empty() && isHeadWhitespace(item.back())) item.remove_suffix(1);
+        if (item.starts_with("W/")) item.remove_prefix(2);
+
+        if (item == "*" || item == etag)
+            return true;
+    }
+
+    return false;
+}
+
+enum class ByteRange { WHOLE, PART, UNSATISFIABLE };
+
+// A single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range. Multiple ranges and
+// anything malformed get the whole file, which is allowed for servers
+static ByteRange parseByteRange(std::string_view range, size_t size, size_t &first, size_t &last) noexcept {
+    if (!range.starts_with("bytes=") || range.find(',') != std::string_view::npos)
+        return ByteRange::WHOLE;
+
+    range.remove_prefix(6);
+    size_t dash = range.find('-');
+    if (dash == std::string_view::npos)
+        return ByteRange::WHOLE;
+
+    auto number = [](std::string_view text, size_t &value) {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return !text.empty() && ec == std::errc{} && end == text.data() + text.size();
+    };
+
+    std::string_view from = range.substr(0, dash), to = range.substr(dash + 1);
+
+    if (from.empty()) {
+        size_t suffix;
+        if (!number(to, suffix))
+            return ByteRange::WHOLE;
+        if (suffix == 0 || size == 0)
+            return ByteRange::UNSATISFIABLE;
+
+        first = size - std::min(suffix, size);
+        last  = size - 1;
+        return ByteRange::PART;
+    }
+
+    if (!number(from, first))
+        return ByteRange::WHOLE;
+
+    if (to.empty())
+        last = SIZE_MAX;
+    else if (!number(to, last) || last < first)
+        return ByteRange::WHOLE;
+
+    if (first >= size)
+        return ByteRange::UNSATISFIABLE;
+
+    last = std::min(last, size - 1);
+    return ByteRange::PART;
+}
+
+static StaticFileCache sStaticFiles;
+
+/*static*/ HttpResponse HttpHandlerBuilder::serveStaticFile(const std::string &path, const HttpRequest &req) {
+    auto file = sStaticFiles.get(path);
+    if (!file) {
+        std::cerr << "Could not locate file: " << path << std::endl;
+        return HttpResponse{404, "text/plain", "The requested file is missing from the server"};
+    }
+
+    // If-None-Match wins over If-Modified-Since when both are sent
+    std::string_view ifNoneMatch = req.header(HttpHeader::IF_NONE_MATCH);
+    time_t since;
+    bool notModified = !ifNoneMatch.empty() ? matchesETag(ifNoneMatch, file->etag)
+                                            : parseHttpDate(req.header(HttpHeader::IF_MODIFIED_SINCE), since) && file->modified <= since;
+
+    const std::string &content = *file->content;
+    size_t first = 0, last     = content.size() - 1;
+    ByteRange range            = ByteRange::WHOLE;
+
+    // A Range only applies to the version of the file named by If-Range
+    std::string_view ifRange = req.header(HttpHeader::IF_RANGE);
+    if (!notModified && (ifRange.empty() || ifRange == file->etag || ifRange == file->lastModified))
+        range = parseByteRange(req.header(HttpHeader::RANGE), content.size(), first, last);
+
+    HttpResponse res{notModified ? 304u : range == ByteRange::PART ? 206u : range == ByteRange::UNSATISFIABLE ? 416u : 200u};
+    res[HttpHeader::ETAG]          = file->etag;
+    res[HttpHeader::LAST_MODIFIED] = file->lastModified;
+
+    if (notModified) {
+        res[HttpHeader::CONTENT_LENGTH] = "";
+        return res;
+    }
+
+    res[HttpHeader::ACCEPT_RANGES] = "bytes";
+
+    if (range == ByteRange::UNSATISFIABLE) {
+        res[HttpHeader::CONTENT_RANGE] = "bytes */" + std::to_string(content.size());
+        return res;
+    }
+
+    res[HttpHeader::CONTENT_TYPE] = getMimeType(path);
+    if (range == ByteRange::PART)
+        res[HttpHeader::CONTENT_RANGE] = "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(content.size());
+
+    res.setSharedContent(file->content, first, content.empty() ? 0 : last - first + 1);
+    return res;
+}
+
+std::shared_ptr<HttpResponse> HttpHandlerBuilder::process(const HttpRequest &req) {
+    auto h = mHandlers.find(req.getMethod());
+
+    if (h == mHandlers.end())
+        return HttpArena::makeShared<HttpResponse>(405, "text/plain", "405 method not allowed");
+
+    ContentCoding coding = mCompress ? negotiateContentCoding(req.header(HttpHeader::ACCEPT_ENCODING)) : ContentCoding::IDENTITY;
+
+    bool cache = mCacheEnabled && req.getMethod() == HttpRequestMethod::GET;
+    auto now   = cache ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+    if (cache) {
+        auto cached = findCached(req.getTarget(), coding);
+        if (cached && (cached->expires == decltype(now){} || now < cached->expires))
+            return HttpArena::makeShared<HttpResponse>(HttpResponse::prebuilt(cached->statusCode, cached->message));
+    }
+
+    // Runs later, the server finishes the response once the handler is done
+    if (h->second.asyncFunc)
+        return HttpArena::makeShared<HttpResponse>(HttpResponse::deferred(finishAsync(h->second.asyncFunc(req), cache ? std::string{req.getTarget()} : std::string{}, coding, cache)));
+
+    auto res = HttpArena::makeShared<HttpResponse>(h->second.func(req));
+
+#ifdef TINYHTTP_COMPRESSION
+    if (mCompress)
+        res->compress(coding, mCompressMinSize);
+#endif
+
+    if (cache)
+        storeCached(req.getTarget(), *res, coding, now);
+
+    return res;
+}
+
+std::shared_ptr<const HttpHandlerBuilder::CachedResponse> HttpHandlerBuilder::findCached(std::string_view path, ContentCoding coding) {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mCacheMutex};
+#endif
+
+    auto cached = mCached.find(path);
+    if (cached == mCached.end())
+        return nullptr;
+
+    return cached->second[static_cast<size_t>(coding)];
+}
+
+void HttpHandlerBuilder::storeCached(std::string_view path, HttpResponse &res, ContentCoding coding, std::chrono::steady_clock::time_point now) {
+    // A handover needs its own response each time, a streamed body only exists while it is sent
+    ICanRequestProtocolHandover *handover;
+    if (res.acceptProtocolHandover(&handover) || res.isStreamed())
+        return;
+
+    // Errors would be answered until the entry is dropped, and a partial response only fits its own Range
+    unsigned status = res.getStatusCode();
+    if (status < 200 || status > 299 || status == 206)
+        return;
+
+    // Entries outlive the arena the response was made in, nothing of them may come from it
+    static_assert(std::is_same_v<MessageBuilder::allocator_type, std::allocator<uint8_t>>, "cached messages have to use the heap");
+
+    auto entry        = std::make_shared<CachedResponse>();
+    entry->statusCode = res.getStatusCode();
+    entry->message    = std::make_shared<const MessageBuilder>(res.buildMessage());
+    if (mCacheTTL != decltype(mCacheTTL)::zero())
+        entry->expires = now + mCacheTTL;
+
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mCacheMutex};
+#endif
+
+    auto cached = mCached.find(path);
+
+    if (cached == mCached.end()) {
+        // Full, room is only made by entries that expired
+        if (mCached.size() >= TINYHTTP_CACHE_MAX_PATHS) {
+            std::erase_if(mCached, [now](const auto &item) {
+                return std::all_of(item.second.begin(), item.second.end(), [now](const auto &entry) {
+                    return !entry || (entry->expires != decltype(now){} && entry->expires <= now);
+                });
+            });
+
+            if (mCached.size() >= TINYHTTP_CACHE_MAX_PATHS)
+                return;
+        }
+
+        cached = mCached.emplace(std::string{path}, CachedPath{}).first;
+    }
+
+    cached->second[static_cast<size_t>(coding)] = std::move(entry);
+}
+
+HttpTask<HttpResponse> HttpHandlerBuilder::finishAsync(HttpTask<HttpResponse> handler, std::string path, ContentCoding coding, bool cache) {
+    HttpResponse res = co_await std::move(handler);
+
+#ifdef TINYHTTP_COMPRESSION
+    if (mCompress)
+        res.compress(coding, mCompressMinSize);
+#endif
+
+    if (cache)
+        storeCached(path, res, coding, std::chrono::steady_clock::now());
+
+    co_return res;
+}
+
+static bool isRouteParameter(std::string_view segment) noexcept {
+    return segment == "*" || (segment.size() >= 2 && segment.front() == '{' && segment.back() == '}');
+}
+
+static bool matchesRouteParameter(PathParamType type, std::string_view segment) noexcept {
+    if (segment.empty())
+        return false;
+
+    switch (type) {
+        case PathParamType::INT:
+            return std::all_of(segment.begin(), segment.end(), [](char ch) { return ch >= '0' && ch <= '9'; });
+        case PathParamType::HEX:
+            return std::all_of(segment.begin(), segment.end(), [](char ch) { return isxdigit(static_cast<unsigned char>(ch)) != 0; });
+        default:
+            return true;
+    }
+}
+
+/*static*/ void HttpRouter::addTo(Handlers &handlers, std::shared_ptr<HandlerBuilder> handler, bool first) {
+    if (first)
+        handlers.insert(handlers.begin(), std::move(handler));
+    else
+        handlers.push_back(std::move(handler));
+}
+
+void HttpRouter::add(std::string_view pattern, std::shared_ptr<HandlerBuilder> handler, bool first) {
+    constexpr size_t npos = std::string_view::npos;
+
+    bool isStatic = true;
+    if (!pattern.empty() && pattern.front() == '/') {
+        for (size_t pos = 1; pos != npos && isStatic;) {
+            size_t end = pattern.find('/', pos);
+            isStatic   = !isRouteParameter(pattern.substr(pos, end == npos ? npos : end - pos));
+            pos        = end == npos ? npos : end + 1;
+        }
+    }
+
+    if (isStatic) {
+        addTo(mStatic[std::string{pattern}], std::move(handler), first);
+        return;
+    }
+
+    Node *node = &mRoot;
+    for (size_t pos = 1; pos != npos;) {
+        size_t end               = pattern.find('/', pos);
+        std::string_view segment = pattern.substr(pos, end == npos ? npos : end - pos);
+        pos                      = end == npos ? npos : end + 1;
+
+        if (!isRouteParameter(segment)) {
+            auto &child = node->literals[std::string{segment}];
+            if (!child)
+                child = std::make_unique<Node>();
+
+            node = child.get();
+            continue;
+        }
+
+        PathParamType type    = PathParamType::STRING;
+        std::string_view name = segment;
+
+        if (segment != "*") {
+            name = segment.substr(1, segment.size() - 2);
+
+            if (!name.empty() && name.back() == '*') {
+                type = PathParamType::REST;
+                name.remove_suffix(1);
+            } else if (size_t colon = name.find(':'); colon != npos) {
+                std::string_view typeName = name.substr(colon + 1);
+                name                      = name.substr(0, colon);
+
+                if (typeName == "int")
+                    type = PathParamType::INT;
+                else if (typeName == "hex")
+                    type = PathParamType::HEX;
+                else if (typeName != "string")
+                    throw std::runtime_error("unknown path parameter type: " + std::string{typeName});
+            }
+        } else {
+            type = PathParamType::REST;
+        }
+
+        if (name.empty())
+            throw std::runtime_error("unnamed path parameter in route: " + std::string{pattern});
+        if (type == PathParamType::REST && pos != npos)
+            throw std::runtime_error("wildcard has to be the last segment of route: " + std::string{pattern});
+
+        auto child = std::find_if(node->params.begin(), node->params.end(), [&](const std::unique_ptr<Node> &p) {
+            return p->type == type && p->name == name;
+        });
+
+        if (child == node->params.end()) {
+            auto created  = std::make_unique<Node>();
+            created->type = type;
+            created->name = name;
+
+            auto where = std::upper_bound(node->params.begin(), node->params.end(), type, [](PathParamType t, const std::unique_ptr<Node> &p) {
+                return t < p->type;
+            });
+            child = node->params.insert(where, std::move(created));
+        }
+
+        node = child->get();
+    }
+
+    addTo(node->handlers, std::move(handler), first);
+}
+
+const HttpRouter::Handlers *HttpRouter::match(std::string_view path, std::vector<PathParam> &params) const {
+    params.clear();
+
+    auto found = mStatic.find(path);
+    if (found != mStatic.end())
+        return &found->second;
+
+    if (path.empty() || path.front() != '/')
+        return nullptr;
+
+    return matchNode(mRoot, path, 1, params);
+}
+
+/*static*/ const HttpRouter::Handlers *HttpRouter::matchNode(const Node &node, std::string_view path, size_t pos, std::vector<PathParam> &params) {
+    constexpr size_t npos = std::string_view::npos;
+
+    if (pos == npos)
+        return node.handlers.empty() ? nullptr : &node.handlers;
+
+    size_t end               = path.find('/', pos);
+    size_t next              = end == npos ? npos : end + 1;
+    std::string_view segment = path.substr(pos, end == npos ? npos : end - pos);
+
+    auto literal = node.literals.find(segment);
+    if (literal != node.literals.end())
+        if (auto handlers = matchNode(*literal->second, path, next, params))
+            return handlers;
+
+    for (auto &param : node.params) {
+        if (param->type == PathParamType::REST) {
+            if (param->handlers.empty())
+                continue;
+
+            params.push_back({param->name, param->type, static_cast<uint32_t>(pos), static_cast<uint32_t>(path.size() - pos)});
+            return &param->handlers;
+        }
+
+        if (!matchesRouteParameter(param->type, segment))
+            continue;
+
+        params.push_back({param->name, param->type, static_cast<uint32_t>(pos), static_cast<uint32_t>(segment.size())});
+        if (auto handlers = matchNode(*param, path, next, params))
+            return handlers;
+
+        params.pop_back();
+    }
+
+    return nullptr;
+}
+
+void HttpResponse::writeHead(MessageBuilder &out) const {
+    char status[16];
+    char *statusEnd = std::to_chars(status, status + sizeof(status), mStatusCode).ptr;
+
+    size_t size = strlen("HTTP/1.1 ") + (statusEnd - status) + 2 + 2;
+    for (auto &h : mHeaders)
+        if (!h.value.empty())
+            size += h.name.size() + 2 + h.value.size() + 2;
+
+    out.reserve(out.size() + size);
+
+    out.write("HTTP/1.1 ");
+    out.write(status, statusEnd - status);
+    out.writeCRLF();
+
+    for (auto &h : mHeaders) {
+        if (h.value.empty()) continue;
+
+        out.write(h.name.data(), h.name.size());
+        out.write(": ", 2);
+        out.write(h.value.data(), h.value.size());
+        out.writeCRLF();
+    }
+
+    out.writeCRLF();
+}
+
+SendSlice HttpResponse::serialize(MessageBuilder &headBuffer) const {
+    if (isPrebuilt())
+        return mPrebuiltMessage;
+
+    writeHead(headBuffer);
+
+    if (mSharedContent)
+        return {mSharedSlice.data(), mSharedSlice.size(), mSharedContent};
+
+    return {mContent.data(), mContent.size()};
+}
+
+void HttpResponse::send(IClientStream &stream, MessageBuilder &headBuffer) const {
+    headBuffer.clear();
+    SendSlice content  = serialize(headBuffer);
+    SendSlice slices[] = {{headBuffer.data(), headBuffer.size()}, content};
+
+    stream.setNoDelay(mNoDelay);
+
+    if (headBuffer.empty())
+        stream.send(&content, 1);
+    else
+        stream.send(slices, content.size == 0 ? 1 : 2);
+}
+
+#ifdef TINYHTTP_COMPRESSION
+// A deflate state is too large to set up for every response, so each thread keeps one per
+// format and resets it for the next body
+class HttpDeflater {
+    z_stream mStream{};
+
+public:
+    MessageBuilder chunk; // compressed chunks of streamed bodies
+
+    explicit HttpDeflater(ContentCoding coding) {
+        // 16 added to the window bits makes zlib write a gzip header and trailer
+        int windowBits = TINYHTTP_COMPRESS_WINDOW_BITS + (coding == ContentCoding::GZIP ? 16 : 0);
+
+        if (deflateInit2(&mStream, TINYHTTP_COMPRESS_LEVEL, Z_DEFLATED, windowBits, 6, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+    }
+
+    ~HttpDeflater() {
+        deflateEnd(&mStream);
+    }
+
+    HttpDeflater(const HttpDeflater &)            = delete;
+    HttpDeflater &operator=(const HttpDeflater &) = delete;
+
+    // The thread's own deflater, a streamed body that has to wait for its client takes it along
+    // by resetting the slot, a new one is made for the next body
+    static std::shared_ptr<HttpDeflater> &forThread(ContentCoding coding) {
+        thread_local std::shared_ptr<HttpDeflater> gzip, deflate;
+
+        auto &deflater = coding == ContentCoding::GZIP ? gzip : deflate;
+        if (!deflater)
+            deflater = std::make_shared<HttpDeflater>(coding);
+
+        return deflater;
+    }
+
+    void reset() noexcept {
+        deflateReset(&mStream);
+    }
+
+    // Appends the compressed data to out, flush is Z_SYNC_FLUSH for parts and Z_FINISH for the end
+    template<typename Out>
+    void run(const void *data, size_t size, int flush, Out &out) {
+        mStream.next_in  = static_cast<Bytef *>(const_cast<void *>(data));
+        mStream.avail_in = size;
+
+        int result;
+        do {
+            size_t pos  = out.size();
+            size_t room = std::max<size_t>(deflateBound(&mStream, mStream.avail_in), 64);
+            out.resize(pos + room);
+
+            mStream.next_out  = reinterpret_cast<Bytef *>(out.data()) + pos;
+            mStream.avail_out = room;
+
+            result = deflate(&mStream, flush);
+            out.resize(pos + room - mStream.avail_out);
+
+            if (result == Z_STREAM_ERROR)
+                throw std::runtime_error("deflate failed");
+        } while (mStream.avail_in > 0 || mStream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+    }
+};
+
+// True if a comma separated list of header names like Vary has the name, or is "*"
+static bool listsHttpHeaderName(std::string_view list, std::string_view name) noexcept {
+    while (!list.empty()) {
+        size_t comma          = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        list                  = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+
+        while (!item.empty() && isHeadWhitespace(item.front())) item.remove_prefix(1);
+        while (!item.empty() && isHeadWhitespace(item.back())) item.remove_suffix(1);
+
+        if (item == "*" || equalsHttpHeaderName(item, name))
+            return true;
+    }
+
+    return false;
+}
+
+void HttpResponse::compress(ContentCoding coding, size_t minSize) {
+    if (isPrebuilt() || mHandover)
+        return;
+
+    // Caches have to know the body depends on Accept-Encoding, also when it isn't compressed this time.
+    // The handler may have listed other headers already
+    std::pmr::string &vary = (*this)[HttpHeader::VARY];
+    if (vary.empty())
+        vary = "Accept-Encoding";
+    else if (!listsHttpHeaderName(vary, "Accept-Encoding"))
+        vary += ", Accept-Encoding";
+
+    if (coding == ContentCoding::IDENTITY || mSharedContent || mStatusCode < 200 || mStatusCode == 204 || mStatusCode == 304 ||
+        !header(HttpHeader::CONTENT_ENCODING).empty())
+        return;
+
+    const char *name = coding == ContentCoding::GZIP ? "gzip" : "deflate";
+
+    if (mProducer) {
+        mProducerCoding                       = coding;
+        (*this)[HttpHeader::CONTENT_ENCODING] = name;
+        return;
+    }
+
+    if (mContent.size() < minSize)
+        return;
+
+    HttpDeflater &deflater = *HttpDeflater::forThread(coding);
+    deflater.reset();
+
+    std::string compressed;
+    compressed.reserve(mContent.size() / 2);
+    deflater.run(mContent.data(), mContent.size(), Z_FINISH, compressed);
+
+    if (compressed.size() >= mContent.size())
+        return;
+
+    (*this)[HttpHeader::CONTENT_ENCODING] = name;
+    setContent(std::move(compressed));
+}
+#endif
+
+bool HttpResponse::sendChunks(IClientStream &stream, MessageBuilder &buffer) {
+    static const char lastChunk[] = "\r\n0\r\n\r\n";
+
+#ifdef TINYHTTP_COMPRESSION
+    if (mProducerCoding != ContentCoding::IDENTITY && !mDeflater) {
+        mDeflater = HttpDeflater::forThread(mProducerCoding);
+        mDeflater->reset();
+    }
+
+    HttpDeflater *deflater = mDeflater.get();
+#endif
+
+    for (bool more = true; more;) {
+        // The producer only runs while the client keeps up, a slow one would make the queue grow instead
+        if (stream.pendingOutput() > TINYHTTP_OUTPUT_HIGH_WATERMARK) {
+#ifdef TINYHTTP_COMPRESSION
+            if (deflater) {
+                auto &own = HttpDeflater::forThread(mProducerCoding);
+                if (own == mDeflater)
+                    own.reset();
+            }
+#endif
+            return false;
+        }
+
+        buffer.clear();
+
+        // Small parts are collected, so every chunk costs a single write
+        while (more && buffer.size() < TINYHTTP_CHUNK_SIZE)
+            more = mProducer(buffer);
+
+        const MessageBuilder *chunk = &buffer;
+
+#ifdef TINYHTTP_COMPRESSION
+        // Flushed after every chunk, so the client can decode as much as it got so far
+        if (deflater) {
+            deflater->chunk.clear();
+            deflater->run(buffer.data(), buffer.size(), more ? Z_SYNC_FLUSH : Z_FINISH, deflater->chunk);
+            chunk = &deflater->chunk;
+        }
+#endif
+
+        if (chunk->empty()) {
+            SendSlice end{lastChunk + 2, sizeof(lastChunk) - 3};
+            stream.send(&end, 1);
+            mStreamedBytes += end.size;
+            break;
+        }
+
+        char sizeLine[sizeof(size_t) * 2 + 2];
+        char *sizeEnd = std::to_chars(sizeLine, sizeLine + sizeof(sizeLine), chunk->size(), 16).ptr;
+        *sizeEnd++    = '\r';
+        *sizeEnd++    = '\n';
+
+        // The last chunk goes out together with the end of the body
+        SendSlice slices[] = {{sizeLine, static_cast<size_t>(sizeEnd - sizeLine)},
+                              {chunk->data(), chunk->size()},
+                              {lastChunk, more ? 2 : sizeof(lastChunk) - 1}};
+        stream.send(slices, 3);
+        mStreamedBytes += slices[0].size + slices[1].size + slices[2].size;
+    }
+
+#ifdef TINYHTTP_COMPRESSION
+    mDeflater.reset();
+#endif
+    return true;
+}
+
+HttpServer::Processor::Processor(std::shared_ptr<IClientStream> stream, HttpServer &owner)
+    : mClientStream{std::move(stream)}, mOwner{owner} {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mOwner.mProcessorListMutex};
+    mListEntry = mOwner.mProcessors.insert(mOwner.mProcessors.end(), this);
+#endif
+}
+
+HttpServer::Processor::~Processor() {
+#ifdef TINYHTTP_THREADING
+    // Has to happen first, the timer thread and a server shutdown may be using this processor
+    mOwner.mTimers.cancel(mDeadline);
+
+    {
+        std::lock_guard lock{mOwner.mProcessorListMutex};
+        mOwner.mProcessors.erase(mListEntry);
+    }
+#endif
+
+    shutdown();
+}
+
+void HttpServer::Processor::setDeadline(Deadline which) {
+#ifdef TINYHTTP_THREADING
+    int timeout = which == Deadline::IDLE   ? TINYHTTP_CLIENT_TIMEOUT
+                  : which == Deadline::HEAD ? TINYHTTP_HEADER_TIMEOUT
+                  : which == Deadline::BODY ? TINYHTTP_BODY_TIMEOUT
+                                            : TINYHTTP_SEND_TIMEOUT;
+
+    if (timeout > 0)
+        mOwner.mTimers.schedule(mDeadline, std::chrono::seconds(timeout));
+    else
+        mOwner.mTimers.cancel(mDeadline);
+#endif
+}
+
+void HttpServer::Processor::clearDeadline() {
+#ifdef TINYHTTP_THREADING
+    mOwner.mTimers.cancel(mDeadline);
+#endif
+}
+
+bool HttpServer::Processor::serveRequest(bool readable) {
+    HttpRequest &req = mRequest;
+
+    // The responses of the last batch are gone once it was sent, this one starts with an empty arena
+    if (mPendingCount == 0 && !mStreamingResponse && !mDeferredResponse)
+        mArena.release();
+
+    if (!mHeadReceived) {
+        // Without polling, there's no telling when a blocking read for the next head starts
+        // getting data, so the idle timeout is used for all of it
+        setDeadline(readable || mClientStream->bufferedBytes() > 0 ? Deadline::HEAD : Deadline::IDLE);
+        receiveHead();
+    }
+
+    mHeadReceived = false;
+
+    if (!mHeadValid) {
+        queueResponse(mOwner.mDefault400Response->serialize(mSendBuffer));
+        return false;
+    }
+
+    // The body is read while the request is processed, by the handler itself when it streams it
+    if (req.hasContent())
+        setDeadline(Deadline::BODY);
+    else
+        clearDeadline();
+
+    if (mOwner.mMetrics)
+        mRequestStart = std::chrono::steady_clock::now();
+
+    std::shared_ptr<HttpResponse> res;
+    {
+        HttpArena::Scope scope{mArena};
+        mRequestMetrics = nullptr;
+        res             = mOwner.processRequest(req, mRequestMetrics);
+    }
+
+    // A coroutine handler may still read the body, the request stays as it is until the handler is done
+    if (res && res->isDeferred()) {
+        mDeferredResponse = std::move(res);
+        clearDeadline();
+
+#ifdef TINYHTTP_TRACING
+        mDeferredSince = std::chrono::steady_clock::now();
+#endif
+
+        // Without an executor, the handler runs to its end right here
+        if (!HttpExecutor::current()) {
+            runDeferred();
+            return finishDeferred();
+        }
+
+        return true;
+    }
+
+    return respond(std::move(res));
+}
+
+void HttpServer::Processor::receiveHead() {
+    try {
+        mHeadValid = mRequest.receiveHead(*mClientStream);
+    } catch (...) {
+        mHeadValid = false;
+    }
+
+    mHeadReceived  = true;
+    mContentPolicy = mHeadValid && mRequest.hasContent() ? mOwner.contentPolicyFor(mRequest) : HttpContentPolicy{};
+}
+
+bool HttpServer::Processor::receiveRequest() {
+    IClientStream &stream = *mClientStream;
+
+    if (!mHeadReceived) {
+        if (!stream.hasBufferedHead()) {
+            bool started = stream.bufferedBytes() > 0;
+            stream.receiveAvailable();
+
+            if (!stream.hasBufferedHead()) {
+                // A head that doesn't fit is answered with a 400 by serveRequest()
+                if (stream.bufferedBytes() >= std::min<size_t>(MAX_HTTP_HEAD_SIZE, TINYHTTP_READ_BUFFER_SIZE))
+                    return true;
+
+                if (!started && stream.bufferedBytes() > 0)
+                    setDeadline(Deadline::HEAD);
+
+                return false;
+            }
+        }
+
+        receiveHead();
+
+        if (mHeadValid && mRequest.hasContent())
+            setDeadline(Deadline::BODY);
+    }
+
+    // A streamed body is the handler's to wait for
+    return !mHeadValid || mContentPolicy.streamed || mRequest.bufferContent(mContentPolicy.maxSize);
+}
+
+bool HttpServer::Processor::hasNextRequest() noexcept {
+    try {
+        return receiveRequest();
+    } catch (...) {
+        return false;
+    }
+}
+
+void HttpServer::Processor::rejectBusy() {
+    mCloseWhenSent = true;
+    setDeadline(Deadline::SEND);
+
+    try {
+        mClientStream->send(mOwner.mDefault503Message.data(), mOwner.mDefault503Message.size());
+    } catch (std::exception &) {
+        interrupt();
+    }
+}
+
+bool HttpServer::Processor::respond(std::shared_ptr<HttpResponse> res) {
+    HttpRequest &req = mRequest;
+
+    // Whatever the handler didn't read has to go before the next request can be parsed
+    [[maybe_unused]] bool reusable = req.discardContent();
+    clearDeadline();
+
+    if (res) {
+#ifndef TINYHTTP_ALLOW_KEEPALIVE
+        if (!res->isPrebuilt())
+            (*res)[HttpHeader::CONNECTION] = "close";
+#endif
+
+#ifdef TINYHTTP_TRACING
+        if (mOwner.mTraceLog && mOwner.mTraceLog->serverTiming && !res->isPrebuilt())
+            setServerTiming(*res);
+
+        auto serializeStart = std::chrono::steady_clock::now();
+#endif
+
+        // Bodies too large to be copied next to their head may wait in the output queue after the
+        // response and the arena it was made in are gone
+        res->shareContent(TINYHTTP_INLINE_BODY_SIZE);
+
+        size_t headStart  = mSendBuffer.size();
+        SendSlice message = res->serialize(mSendBuffer);
+
+#ifndef TINYHTTP_ALLOW_KEEPALIVE
+        // Cached and default messages are shared, the header goes in behind their status line here
+        if (res->isPrebuilt()) {
+            std::string_view prebuilt{static_cast<const char *>(message.data), message.size};
+            size_t statusEnd = prebuilt.find("\r\n");
+            size_t lineSize  = statusEnd == std::string_view::npos ? 0 : statusEnd + 2;
+
+            mSendBuffer.write(prebuilt.data(), lineSize);
+            mSendBuffer.write("Connection: close\r\n");
+            message.data = prebuilt.data() + lineSize;
+            message.size = prebuilt.size() - lineSize;
+        }
+#endif
+
+#ifdef TINYHTTP_TRACING
+        req.trace().add(HttpTrace::SERIALIZE, serializeStart);
+#endif
+
+        recordRequest(res->getStatusCode(), mSendBuffer.size() - headStart + message.size);
+
+        queueResponse(message);
+        mPendingNoDelay = res->noDelay();
+
+        if (res->acceptProtocolHandover(&mHandover)) {
+            mHandoverRequest = std::make_unique<HttpRequest>(req);
+            mPendingResponses.push_back(std::move(res));
+            return false;
+        }
+
+        if (res->isStreamed()) {
+            // The head and everything queued before it go out first, the body follows chunk by chunk
+            flushResponses();
+            mStreamingResponse = std::move(res);
+            mStreamingMetrics  = mRequestMetrics;
+        } else {
+            mPendingResponses.push_back(std::move(res));
+        }
+    } else {
+        queueResponse({mOwner.mDefault404Message.data(), mOwner.mDefault404Message.size()});
+        recordRequest(404, mOwner.mDefault404Message.size());
+    }
+
+#ifdef TINYHTTP_ALLOW_KEEPALIVE
+    bool keepAlive = reusable && req.header(HttpHeader::CONNECTION) == "keep-alive";
+#else
+    bool keepAlive = false;
+#endif
+
+    if (mStreamingResponse) {
+        mStreamKeepAlive = keepAlive;
+        return continueStreaming();
+    }
+
+    return keepAlive;
+}
+
+void HttpServer::Processor::recordRequest(unsigned statusCode, uint64_t bytesOut) {
+    if (mRequestMetrics)
+        mRequestMetrics->record(statusCode, mRequest.receivedBytes(), bytesOut, std::chrono::steady_clock::now() - mRequestStart);
+
+#ifdef TINYHTTP_TRACING
+    // The request is reused by the next one before this response is sent
+    if (mOwner.mTraceLog) {
+        mPendingTraces.push_back(mRequest.trace());
+        mPendingTraces.back().statusCode = statusCode;
+    }
+#endif
+}
+
+#ifdef TINYHTTP_TRACING
+void HttpServer::Processor::setServerTiming(HttpResponse &res) {
+    const HttpTrace &trace = mRequest.trace();
+    char timing[256];
+    size_t len = 0;
+
+    // Serializing and sending come after the header is written
+    for (unsigned phase = HttpTrace::HEAD; phase <= HttpTrace::HANDLER && len < sizeof(timing); phase++)
+        len += snprintf(timing + len, sizeof(timing) - len, "%s%s;dur=%.3f", len > 0 ? ", " : "", HttpTrace::kPhaseNames[phase],
+                        trace.nanos[phase] / 1e6);
+
+    res["Server-Timing"] = std::string_view{timing, std::min(len, sizeof(timing) - 1)};
+}
+#endif
+
+bool HttpServer::Processor::startDeferred(std::function<void()> done) {
+    return mDeferredResponse->task().start(std::move(done));
+}
+
+void HttpServer::Processor::runDeferred() {
+#ifdef TINYHTTP_THREADING
+    // It may still wait for something another thread finishes
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;
+
+    bool doneNow = startDeferred([&]() {
+        std::lock_guard lock{mutex};
+        done = true;
+        finished.notify_one();
+    });
+
+    if (!doneNow) {
+        std::unique_lock lock{mutex};
+        finished.wait(lock, [&]() { return done; });
+    }
+#else
+    startDeferred([]() {});
+#endif
+}
+
+bool HttpServer::Processor::finishDeferred() {
+    auto deferred = std::move(mDeferredResponse);
+    std::shared_ptr<HttpResponse> res;
+
+    try {
+        HttpArena::Scope scope{mArena};
+        res = HttpArena::makeShared<HttpResponse>(deferred->task().result());
+    } catch (HttpRequestError &e) {
+        res = e.statusCode == 413 ? mOwner.mDefault413Response : mOwner.mDefault400Response;
+    } catch (std::exception &e) {
+        std::cerr << "Exception while handling request (" << mRequest.getPath() << "): " << e.what() << std::endl;
+        res = mOwner.mDefault500Response;
+    }
+
+    if (mRequest.hasContent())
+        setDeadline(Deadline::BODY);
+
+#ifdef TINYHTTP_TRACING
+    mRequest.trace().add(HttpTrace::HANDLER, mDeferredSince);
+#endif
+
+    return respond(std::move(res));
+}
+
+bool HttpServer::Processor::continueStreaming() {
+    auto countStreamed = [this, before = mStreamingResponse->streamedBytes()]() {
+        if (mStreamingMetrics)
+            mStreamingMetrics->addBytesOut(mStreamingResponse->streamedBytes() - before);
+    };
+
+    try {
+        bool done = mStreamingResponse->sendChunks(*mClientStream, mSendBuffer);
+        mSendBuffer.clear();
+        countStreamed();
+
+        // Stopped early, the rest follows once the client took most of what is queued
+        if (!done)
+            return true;
+    } catch (std::exception &e) {
+        // Too late for an error response, ending the connection tells the client the body is incomplete
+        std::cerr << "Exception while streaming response (" << mRequest.getPath() << "): " << e.what() << std::endl;
+        countStreamed();
+        mSendBuffer.clear();
+        mStreamingResponse.reset();
+        return false;
+    }
+
+    mStreamingResponse.reset();
+    return mStreamKeepAlive;
+}
+
+bool HttpServer::Processor::serveRequests(bool readable) {
+    bool keepAlive = isDeferred() ? finishDeferred() : isStreaming() ? continueStreaming() : serveRequest(readable);
+
+    // Pipelined requests wait while a streamed response is unfinished, a coroutine handler isn't done, or the client is behind
+    while (keepAlive && !isStreaming() && !isDeferred() && mPendingCount < TINYHTTP_PIPELINE_DEPTH &&
+           mClientStream->pendingOutput() <= TINYHTTP_OUTPUT_LOW_WATERMARK && hasNextRequest())
+        keepAlive = serveRequest(true);
+
+    flushResponses();
+    return keepAlive;
+}
+
+void HttpServer::Processor::queueResponse(SendSlice data) {
+    if (data.size <= TINYHTTP_INLINE_BODY_SIZE)
+        mSendBuffer.write(data.data, data.size);
+    else
+        mPendingBodies.push_back({mSendBuffer.size(), std::move(data)});
+
+    mPendingCount++;
+}
+
+void HttpServer::Processor::flushResponses() {
+    if (mPendingCount == 0)
+        return;
+
+    // Slices into the send buffer are only made now, writing to it may have moved it
+    size_t pos = 0;
+    for (auto &[offset, body] : mPendingBodies) {
+        if (offset > pos)
+            mSendSlices.push_back({mSendBuffer.data() + pos, offset - pos});
+
+        mSendSlices.push_back(body);
+        pos = offset;
+    }
+
+    if (mSendBuffer.size() > pos)
+        mSendSlices.push_back({mSendBuffer.data() + pos, mSendBuffer.size() - pos});
+
+    auto reset = [this]() {
+        mSendSlices.clear();
+        mPendingBodies.clear();
+        mPendingResponses.clear();
+        mSendBuffer.clear();
+        mPendingCount   = 0;
+        mPendingNoDelay = true;
+#ifdef TINYHTTP_TRACING
+        mPendingTraces.clear();
+#endif
+    };
+
+#ifdef TINYHTTP_TRACING
+    auto sendStart = std::chrono::steady_clock::now();
+#endif
+
+    try {
+        mClientStream->setNoDelay(mPendingNoDelay);
+        mClientStream->send(mSendSlices.data(), mSendSlices.size());
+    } catch (...) {
+        reset();
+        throw;
+    }
+
+#ifdef TINYHTTP_TRACING
+    for (auto &trace : mPendingTraces) {
+        auto sent        = trace.add(HttpTrace::SEND, sendStart);
+        trace.totalNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(sent - trace.start).count();
+        mOwner.logTrace(trace);
+    }
+#endif
+
+    reset();
+}
+
+void HttpServer::Processor::runHandover() {
+    puts("Doing handover");
+    mHasHandover = true;
+    clearDeadline();
+
+    // Handovers are written to from other threads, without the reactor watching the connection
+    // this thread sends what they queued while it waits for input
+    mClientStream->flushOutputOnRead();
+
+    mOwner.mActiveHandovers++;
+    try {
+        mHandover->acceptHandover(mOwner.mSocket, *mClientStream.get(), std::move(mHandoverRequest));
+    } catch (...) {
+        mOwner.mActiveHandovers--;
+        throw;
+    }
+    mOwner.mActiveHandovers--;
+
+    puts("Handover proc exited");
+}
+
+/* static */ void HttpServer::Processor::clientThreadProc(std::shared_ptr<Processor> self) {
+    try {
+        while (!self->wantsHandover() && self->mClientStream->isOpen() && self->isAlive()) {
+            bool keepAlive = self->serveRequests(false);
+
+            // This thread has nothing else to do, so it waits for the client itself
+            while (keepAlive && self->isStreaming()) {
+                self->mClientStream->drainOutput(TINYHTTP_OUTPUT_LOW_WATERMARK);
+                keepAlive = self->serveRequests(false);
+            }
+
+            self->mClientStream->drainOutput(0);
+
+            if (!keepAlive)
+                break;
+        }
+
+        if (self->wantsHandover())
+            self->runHandover();
+    } catch (std::exception &e) {
+        // Don't print the exception when we are getting shut down, it's expected to be raised
+        if (self->isAlive()) {
+            std::cerr << "Exception in HTTP client handler (" << e.what() << ")\n";
+        }
+    }
+
+    self->shutdown();
+}
+
+void HttpServer::Processor::shutdown() {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mShutdownMutex};
+#endif
+
+    mIsAlive = false;
+
+    if (mClientStream && mClientStream->isOpen())
+        mClientStream->close();
+
+#ifdef TINYHTTP_THREADING
+    if (mWorkThread && mWorkThread->joinable())
+        mWorkThread->detach();
+#endif
+}
+
+void HttpServer::Processor::interrupt() {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mShutdownMutex};
+#endif
+
+    mIsAlive = false;
+
+    if (mClientStream)
+        mClientStream->interrupt();
+}
+
+#ifdef TINYHTTP_THREADING
+void HttpServer::Processor::startThread() {
+    auto self_ptr = shared_from_this();
+
+    // Held until the thread is stored, a connection that ends at once must still find it to detach it
+    std::lock_guard lock{mShutdownMutex};
+    mWorkThread.reset(new std::thread{[self_ptr]() {
+        clientThreadProc(self_ptr);
+    }});
+}
+
+void HttpServer::Processor::startHandoverThread() {
+    // Handovers own the connection until it closes, so they get their own thread
+    // instead of pinning one of the reactor's workers
+    auto self_ptr = shared_from_this();
+    mHasHandover  = true;
+
+    std::lock_guard lock{mShutdownMutex};
+    mWorkThread.reset(new std::thread{[self_ptr]() {
+        clientThreadProc(self_ptr);
+    }});
+}
+
+HttpTimerWheel::HttpTimerWheel() {
+    mThread = std::thread{[this]() { timerThreadProc(); }};
+}
+
+HttpTimerWheel::~HttpTimerWheel() {
+    {
+        std::lock_guard lock{mMutex};
+        mStopping = true;
+    }
+
+    mChanged.notify_one();
+
+    if (mThread.joinable())
+        mThread.join();
+}
+
+uint64_t HttpTimerWheel::currentTick() const {
+    return std::chrono::duration_cast<Tick>(std::chrono::steady_clock::now() - mEpoch).count();
+}
+
+bool HttpTimerWheel::empty() const noexcept {
+    for (size_t count : mLevelCounts)
+        if (count > 0)
+            return false;
+
+    return true;
+}
+
+void HttpTimerWheel::link(Timer &timer) {
+    // Timers land on the finest wheel that reaches their tick, cascading moves them further down
+    uint64_t delta = timer.mExpires - mCurrentTick;
+    unsigned level = 0;
+
+    while (level < kLevels - 1 && delta >= (kSlots << (level * kSlotBits)))
+        level++;
+
+    Timer *&slot = mSlots[level][(timer.mExpires >> (level * kSlotBits)) & (kSlots - 1)];
+
+    timer.mLevel = level;
+    timer.mNext  = slot;
+    timer.mLink  = &slot;
+    if (slot)
+        slot->mLink = &timer.mNext;
+
+    slot = &timer;
+    mLevelCounts[level]++;
+}
+
+void HttpTimerWheel::unlink(Timer &timer) {
+    *timer.mLink = timer.mNext;
+    if (timer.mNext)
+        timer.mNext->mLink = timer.mLink;
+
+    timer.mLink = nullptr;
+    timer.mNext = nullptr;
+    mLevelCounts[timer.mLevel]--;
+}
+
+void HttpTimerWheel::schedule(Timer &timer, std::chrono::steady_clock::duration timeout) {
+    std::lock_guard lock{mMutex};
+
+    if (timer.mLink)
+        unlink(timer);
+
+    // The wheel doesn't move while it's empty, catch up before measuring from it
+    uint64_t now = currentTick();
+    if (empty())
+        mCurrentTick = now;
+
+    constexpr uint64_t maxDelta = (kSlots << ((kLevels - 1) * kSlotBits)) - 1;
+    uint64_t ticks              = std::chrono::ceil<Tick>(timeout).count();
+
+    timer.mExpires = std::min(std::max(now + ticks, mCurrentTick + 1), mCurrentTick + maxDelta);
+    link(timer);
+
+    if (timer.mExpires < mWakeTick)
+        mChanged.notify_one();
+}
+
+void HttpTimerWheel::cancel(Timer &timer) {
+    std::lock_guard lock{mMutex};
+
+    if (timer.mLink)
+        unlink(timer);
+}
+
+void HttpTimerWheel::advanceTo(uint64_t tick) {
+    while (mCurrentTick < tick) {
+        if (empty()) {
+            mCurrentTick = tick;
+            return;
+        }
+
+        uint64_t current = ++mCurrentTick;
+
+        // Entering a new round of a wheel, bring the timers of its next slot down a level
+        for (unsigned level = 1; level < kLevels; level++) {
+            if (current & ((uint64_t{1} << (level * kSlotBits)) - 1))
+                break;
+
+            Timer *timer = mSlots[level][(current >> (level * kSlotBits)) & (kSlots - 1)];
+            while (timer) {
+                Timer *next = timer->mNext;
+                unlink(*timer);
+                link(*timer);
+                timer = next;
+            }
+        }
+
+        Timer *timer = mSlots[0][current & (kSlots - 1)];
+        while (timer) {
+            Timer *next = timer->mNext;
+            unlink(*timer);
+            timer->onTimerExpired();
+            timer = next;
+        }
+    }
+}
+
+uint64_t HttpTimerWheel::nextEventTick() const {
+    if (empty())
+        return UINT64_MAX;
+
+    bool cascades = false;
+    for (unsigned level = 1; level < kLevels; level++)
+        cascades |= mLevelCounts[level] > 0;
+
+    for (uint64_t tick = mCurrentTick + 1;; tick++) {
+        if (mSlots[0][tick & (kSlots - 1)])
+            return tick;
+
+        if (cascades && (tick & (kSlots - 1)) == 0)
+            return tick;
+    }
+}
+
+void HttpTimerWheel::timerThreadProc() {
+    std::unique_lock lock{mMutex};
+
+    while (!mStopping) {
+        advanceTo(currentTick());
+
+        mWakeTick = nextEventTick();
+        if (mWakeTick == UINT64_MAX)
+            mChanged.wait(lock);
+        else
+            mChanged.wait_until(lock, mEpoch + Tick{mWakeTick});
+    }
+}
+#endif
+
+#ifdef TINYHTTP_REACTOR
+HttpWorkerPool::HttpWorkerPool(size_t threads, size_t maxQueued) : mMaxQueued{maxQueued} {
+    mThreads.reserve(threads);
+
+    for (size_t i = 0; i < threads; i++)
+        mThreads.emplace_back([this]() { workerThreadProc(); });
+}
+
+void HttpWorkerPool::workerThreadProc() {
+    while (true) {
+        std::function<void()> task;
+
+        {
+            std::unique_lock lock{mMutex};
+            mTaskAvailable.wait(lock, [this]() { return mStopping || !mQueue.empty(); });
+
+            if (mStopping)
+                return;
+
+            task = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+
+        try {
+            task();
+        } catch (std::exception &e) {
+            std::cerr << "Exception in HTTP worker (" << e.what() << ")\n";
+        }
+    }
+}
+
+bool HttpWorkerPool::trySubmit(std::function<void()> task) {
+    {
+        std::lock_guard lock{mMutex};
+        if (mStopping || mQueue.size() >= mMaxQueued)
+            return false;
+
+        mQueue.push_back(std::move(task));
+    }
+
+    mTaskAvailable.notify_one();
+    return true;
+}
+
+bool HttpWorkerPool::post(std::function<void()> task) {
+    {
+        std::lock_guard lock{mMutex};
+        if (mStopping)
+            return false;
+
+        mQueue.push_back(std::move(task));
+    }
+
+    mTaskAvailable.notify_one();
+    return true;
+}
+
+size_t HttpWorkerPool::queueDepth() {
+    std::lock_guard lock{mMutex};
+    return mQueue.size();
+}
+
+void HttpWorkerPool::stop() {
+    std::deque<std::function<void()>> dropped;
+
+    {
+        std::lock_guard lock{mMutex};
+        mStopping = true;
+        dropped.swap(mQueue);
+    }
+
+    mTaskAvailable.notify_all();
+
+    for (auto &t : mThreads)
+        if (t.joinable())
+            t.join();
+}
+
+class HttpServer::Reactor : public std::enable_shared_from_this<Reactor>, public HttpExecutor {
+    struct IoLoop {
+        std::thread thread;
+        std::mutex incomingMutex;
+        std::vector<std::shared_ptr<Processor>> incoming;
+        int wakeSocket = -1;
+    };
+
+    HttpWorkerPool mWorkers;
+    HttpWorkerPool mBlockingCalls; // offloaded by coroutine handlers
+    std::vector<std::unique_ptr<IoLoop>> mLoops;
+    std::atomic<size_t> mNextLoop{0};
+    std::atomic<bool> mStopping{false};
+
+    void ioThreadProc(IoLoop &loop);
+    void serve(std::shared_ptr<Processor> processor);
+
+    enum class Next {
+        WAIT,  // keep polling the connection
+        SERVE, // hand it to a worker
+        DROP,  // stop watching it
+    };
+
+    // Sends what the client takes of the pending output once the connection is writable
+    Next sendPending(Processor &processor);
+
+    // Reads what the client sent once the connection is readable, a worker only gets it with a whole request
+    Next receivePending(Processor &processor);
+
+    static void wake(IoLoop &loop) {
+        char ch = 0;
+        ::send(loop.wakeSocket, &ch, 1, MSG_NOSIGNAL);
+    }
+
+public:
+    Reactor(size_t ioThreads, size_t workerThreads, size_t maxQueued);
+    ~Reactor() { stop(); }
+
+    // Takes over a new connection, from now on its output is sent from the I/O threads
+    // whenever the client doesn't take all of it right away
+    void attach(std::shared_ptr<Processor> processor);
+
+    // Hands a connection to one of the I/O threads, which passes it to a worker once a whole request
+    // arrived, or first sends its pending output
+    bool watch(std::shared_ptr<Processor> processor);
+    void stop();
+
+    void resume(std::coroutine_handle<> handle) override;
+    bool runBlocking(std::function<void()> call) override;
+
+    inline size_t queueDepth() {
+        return mWorkers.queueDepth();
+    }
+};
+
+HttpServer::Reactor::Reactor(size_t ioThreads, size_t workerThreads, size_t maxQueued)
+    : mWorkers{workerThreads, maxQueued}, mBlockingCalls{TINYHTTP_BLOCKING_THREADS, 0} {
+    for (size_t i = 0; i < ioThreads; i++) {
+        auto loop = std::make_unique<IoLoop>();
+
+        // poll() can't wait on a condition variable, so the I/O threads are woken up through a socket
+        loop->wakeSocket = openWakeSocket();
+
+        if (loop->wakeSocket < 0) {
+            perror("reactor wakeup socket");
+            stop();
+            throw std::runtime_error("Could not create reactor wakeup socket");
+        }
+
+        IoLoop *loopPtr = loop.get();
+        loop->thread    = std::thread{[this, loopPtr]() { ioThreadProc(*loopPtr); }};
+        mLoops.push_back(std::move(loop));
+    }
+}
+
+void HttpServer::Reactor::ioThreadProc(IoLoop &loop) {
+    std::vector<std::shared_ptr<Processor>> watched;
+    std::vector<struct pollfd> fds;
+    char drain[16];
+
+    while (!mStopping) {
+        {
+            std::lock_guard lock{loop.incomingMutex};
+            for (auto &processor : loop.incoming)
+                watched.push_back(std::move(processor));
+            loop.incoming.clear();
+        }
+
+        // Connections closed by the cleanup thread or a server shutdown are dropped here
+        std::erase_if(watched, [](const std::shared_ptr<Processor> &processor) {
+            return !processor->isAlive() || !processor->stream().isOpen();
+        });
+
+        fds.resize(watched.size() + 1);
+        fds[0] = {loop.wakeSocket, POLLIN, 0};
+
+        // Connections aren't read from again until the client took the output that waits for it
+        for (size_t i = 0; i < watched.size(); i++) {
+            Processor &processor = *watched[i];
+            bool sending         = processor.hasHandover() || processor.isStreaming() || processor.closeWhenSent() ||
+                           processor.stream().pendingOutput() > 0;
+
+            fds[i + 1] = {processor.stream().nativeHandle(), static_cast<short>(sending ? POLLOUT : POLLIN), 0};
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("poll failed");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            recv(loop.wakeSocket, drain, sizeof(drain), MSG_NOSIGNAL);
+
+        // Walk backwards, so ready connections can be swapped out without skipping any
+        for (size_t i = watched.size(); i-- > 0;) {
+            if (fds[i + 1].revents == 0)
+                continue;
+
+            Next next = (fds[i + 1].events & POLLOUT) ? sendPending(*watched[i]) : receivePending(*watched[i]);
+            if (next == Next::WAIT)
+                continue;
+
+            auto processor = std::move(watched[i]);
+            watched[i]     = std::move(watched.back());
+            watched.pop_back();
+
+            if (next == Next::DROP)
+                continue;
+
+            // A streamed response was accepted before and continues even if the queue is full. A new request
+            // gets a 503 then, rather than this thread waiting for a worker while its other connections stall
+            auto task = [this, processor]() { serve(processor); };
+            if (processor->isStreaming() ? mWorkers.post(task) : mWorkers.trySubmit(task))
+                continue;
+
+            if (mStopping)
+                break;
+
+            processor->rejectBusy();
+            watched.push_back(std::move(processor));
+        }
+    }
+}
+
+HttpServer::Reactor::Next HttpServer::Reactor::sendPending(Processor &processor) {
+    IClientStream &stream = processor.stream();
+    size_t before         = stream.pendingOutput();
+
+    try {
+        stream.flushOutput();
+    } catch (std::exception &) {
+        // Whoever else uses the connection finds out with their next read or write
+        processor.interrupt();
+        return Next::DROP;
+    }
+
+    size_t pending = stream.pendingOutput();
+
+    // Written to by its own thread, which queues more whenever it wants
+    if (processor.hasHandover()) {
+        if (pending > 0)
+            return Next::WAIT;
+
+        // More may have been queued right before the flag was cleared, its sender relied on it being watched
+        processor.clearOutputWatched();
+        return stream.pendingOutput() > 0 && processor.markOutputWatched() ? Next::WAIT : Next::DROP;
+    }
+
+    if (processor.isStreaming() && pending <= TINYHTTP_OUTPUT_LOW_WATERMARK) {
+        processor.clearDeadline();
+        return Next::SERVE;
+    }
+
+    if (pending > 0) {
+        if (pending < before)
+            processor.setDeadline(Processor::Deadline::SEND);
 
-    short sock = accept(
-            listener,
-            reinterpret_cast<struct sockaddr *>(&client),
-            const_cast<socklen_t *>(reinterpret_cast<const socklen_t *>(&clientLen)));
+        return Next::WAIT;
+    }
 
-    if (sock < 0) {
-        perror("accept failed");
-        return {-1};
+    if (processor.closeWhenSent()) {
+        processor.shutdown();
+        return Next::DROP;
     }
 
-    return {sock};
+    // Everything went out, the connection waits for the next request now. Part of it may have been read already
+    processor.setDeadline(Processor::Deadline::IDLE);
+    return receivePending(processor);
 }
 
-void TCPClientStream::send(const void *what, size_t size) {
-    if (::send(mSocket, what, size, MSG_NOSIGNAL) < 0)
-        throw std::runtime_error("TCP send failed");
-}
+HttpServer::Reactor::Next HttpServer::Reactor::receivePending(Processor &processor) {
+    try {
+        if (processor.receiveRequest())
+            return Next::SERVE;
+    } catch (std::exception &) {
+        // Closed or failed between requests, or while one was arriving
+        processor.shutdown();
+        return Next::DROP;
+    }
 
-size_t TCPClientStream::receive(void *target, size_t max) {
-    ssize_t len;
+    return Next::WAIT;
+}
 
-    if ((len = recv(mSocket, target, max, MSG_NOSIGNAL)) < 0)
-        throw std::runtime_error("TCP receive failed");
+void HttpServer::Reactor::serve(std::shared_ptr<Processor> processor) {
+    HttpExecutor::Scope executor{*this};
 
-    return static_cast<size_t>(len);
-}
+    try {
+        bool keepAlive;
+
+        // Requests the client already sent are answered right away instead of going back to poll(),
+        // as long as the client keeps up with the responses
+        do {
+            keepAlive = processor->serveRequests(true);
+
+            // A coroutine handler that waits for something continues without this worker, the connection
+            // is served again once the handler is done. One that is done right away is answered here
+            while (processor->isDeferred()) {
+                bool done = processor->startDeferred([reactor = weak_from_this(), processor]() {
+                    auto self = reactor.lock();
+                    if (!self || !self->mWorkers.post([self = self.get(), processor]() { self->serve(processor); }))
+                        processor->shutdown();
+                });
+
+                if (!done)
+                    return;
+
+                keepAlive = processor->serveRequests(true);
+            }
+        } while (keepAlive && processor->isAlive() && !processor->isStreaming() &&
+                 processor->stream().pendingOutput() <= TINYHTTP_OUTPUT_LOW_WATERMARK && processor->hasNextRequest());
 
-std::string TCPClientStream::receiveLine(bool asciiOnly, size_t max) {
-    std::string res;
-    char ch;
+        if (processor->wantsHandover()) {
+            processor->startHandoverThread();
 
-    while (res.size() < max) {
-        if (recv(mSocket, &ch, 1, MSG_NOSIGNAL) != 1)
-            throw std::runtime_error("TCP receive failed");
+            // The handshake response may still be queued, it is sent together with the handler's output
+            if (processor->stream().pendingOutput() > 0 && processor->markOutputWatched())
+                watch(processor);
 
-        if (ch == '\r') continue;
-        if (ch == '\n') break;
+            return;
+        }
 
-        if (asciiOnly && !isascii(ch))
-            throw std::runtime_error("Only ASCII characters were allowed");
+        bool sending = processor->isStreaming() || processor->stream().pendingOutput() > 0;
 
-        res.push_back(ch);
+        // What the client didn't take yet is sent from the I/O thread, a connection that isn't reused closes afterwards
+        if ((keepAlive || sending) && processor->isAlive()) {
+            processor->setCloseWhenSent(!keepAlive);
+            processor->setDeadline(sending ? Processor::Deadline::SEND : Processor::Deadline::IDLE);
+            if (watch(processor))
+                return;
+        }
+    } catch (std::exception &e) {
+        // Don't print the exception when we are getting shut down, it's expected to be raised
+        if (processor->isAlive()) {
+            std::cerr << "Exception in HTTP client handler (" << e.what() << ")\n";
+        }
     }
 
-    return res;
+    processor->shutdown();
 }
 
-void TCPClientStream::close() {
-    if (mSocket < 0) return;
-    ::shutdown(mSocket, SHUT_RDWR);
-    ::close(mSocket);
-    mSocket = -1;
-}
+void HttpServer::Reactor::attach(std::shared_ptr<Processor> processor) {
+    // Responses are queued by the worker serving the connection, which watches it again when it's done.
+    // Handed over connections are written to from their own thread and others, so their output is watched
+    // as soon as some of it has to wait
+    processor->stream().setOutputWatcher([reactor = weak_from_this(), weakProcessor = std::weak_ptr<Processor>{processor}]() {
+        auto self      = reactor.lock();
+        auto processor = weakProcessor.lock();
 
-bool HttpRequest::parse(std::shared_ptr<IClientStream> stream) {
-    std::istringstream iss(stream->receiveLine());
-    std::vector<std::string> results(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
+        if (!self || !processor)
+            return false;
+
+        if (!processor->hasHandover() || !processor->markOutputWatched())
+            return true;
 
-    if (results.size() < 2)
+        if (self->watch(processor))
+            return true;
+
+        processor->clearOutputWatched();
         return false;
+    });
+
+    processor->setDeadline(Processor::Deadline::IDLE);
+    watch(std::move(processor));
+}
 
-    std::string methodString = results[0];
-    if (methodString == "GET") {
-        mMethod = HttpRequestMethod::GET;
-    } else if (methodString == "POST") {
-        mMethod = HttpRequestMethod::POST;
-    } else if (methodString == "PUT") {
-        mMethod = HttpRequestMethod::PUT;
-    } else if (methodString == "DELETE") {
-        mMethod = HttpRequestMethod::DELETE;
-    } else if (methodString == "OPTIONS") {
-        mMethod = HttpRequestMethod::OPTIONS;
-    } else
+bool HttpServer::Reactor::watch(std::shared_ptr<Processor> processor) {
+    if (mStopping)
         return false;
 
-    path = results[1];
+    auto &loop = *mLoops[mNextLoop++ % mLoops.size()];
 
-    size_t question = path.find("?");
-    if (question != std::string::npos) {
-        query = path.substr(question);
-        path  = path.substr(0, question);
+    {
+        std::lock_guard lock{loop.incomingMutex};
+        loop.incoming.push_back(std::move(processor));
     }
 
-    if (query.empty())
-        std::cout << methodString << " " << path << std::endl;
-    else
-        std::cout << methodString << " " << path << " (Query: " << query << ")" << std::endl;
+    wake(loop);
+    return true;
+}
 
-    while (true) {
-        std::string line = stream->receiveLine();
+void HttpServer::Reactor::resume(std::coroutine_handle<> handle) {
+    if (!mWorkers.post([this, handle]() {
+            HttpExecutor::Scope executor{*this};
+            handle.resume();
+        }))
+        handle.resume();
+}
 
-        if (line.empty()) break;
+bool HttpServer::Reactor::runBlocking(std::function<void()> call) {
+    return mBlockingCalls.post(std::move(call));
+}
 
-        size_t sep = line.find(": ");
-        if (sep == std::string::npos || sep == 0)
-            return false;
+void HttpServer::Reactor::stop() {
+    // Stop the workers first, then the I/O threads that hand them connections
+    mWorkers.stop();
+    mBlockingCalls.stop();
+
+    if (mStopping.exchange(true))
+        return;
 
-        std::string key = line.substr(0, sep), val = line.substr(sep + 2);
-        (*this)[key] = val;
-        //std::cout << "HEADER: <" << key << "> set to <" << val << ">" << std::endl;
+    for (auto &loop : mLoops)
+        wake(*loop);
+
+    for (auto &loop : mLoops) {
+        if (loop->thread.joinable())
+            loop->thread.join();
+
+        ::close(loop->wakeSocket);
     }
 
-    std::string contentLength = (*this)["Content-Length"];
-    ssize_t cl                = std::atoll(contentLength.c_str());
+    mLoops.clear();
+}
+#endif
+
+std::shared_ptr<HttpResponse> HttpAssetHandler::process(const HttpRequest &req) {
+    if (req.getMethod() != HttpRequestMethod::GET)
+        return HttpArena::makeShared<HttpResponse>(405, "text/plain", "405 method not allowed");
+
+    std::string_view ifNoneMatch = req.header(HttpHeader::IF_NONE_MATCH);
+    if (!ifNoneMatch.empty() && matchesETag(ifNoneMatch, mAsset.etag))
+        return HttpArena::makeShared<HttpResponse>(HttpResponse::prebuilt(304, mAsset.notModified));
 
-    if (cl > MAX_HTTP_CONTENT_SIZE)
-        throw std::runtime_error("request too large");
+    if (mAsset.gzip.size > 0 && acceptsHttpEncoding(req.header(HttpHeader::ACCEPT_ENCODING), "gzip"))
+        return HttpArena::makeShared<HttpResponse>(HttpResponse::prebuilt(200, mAsset.gzip));
 
-    if (cl > 0) {
-        char *tmp = new char[cl];
-        bzero(tmp, cl);
-        stream->receive(tmp, cl);
+    return HttpArena::makeShared<HttpResponse>(HttpResponse::prebuilt(200, mAsset.identity));
+}
 
-        mContent = std::string(tmp, cl);
-        delete[] tmp;
+void HttpServer::serveAssets(std::string_view prefix, std::span<const HttpAsset> assets) {
+    std::string base{prefix};
+    if (base.empty() || base.back() != '/')
+        base += '/';
 
-#ifdef TINYHTTP_JSON
-        if ((*this)["Content-Type"] == "application/json" || (*this)["Content-Type"].rfind("application/json;", 0) == 0 // some clients gives us extra data like charset
-        ) {
-            std::string error;
-            mContentJson = miniJson::Json::parse(mContent, error);
-            if (!error.empty())
-                std::cerr << "Content type was JSON but we couldn't parse it! " << error << std::endl;
+    for (auto &asset : assets) {
+        auto h = std::make_shared<HttpAssetHandler>(asset);
+        std::string_view path{asset.path};
+
+        // Counted together, one label per file would only blow up the metrics
+        addRouteLabel(base + "*", *h);
+
+        mRouter.add(base + std::string{path}, h);
+
+        if (path == "index.html" || path.ends_with("/index.html")) {
+            std::string dir = base + std::string{path.substr(0, path.size() - strlen("index.html"))};
+            mRouter.add(dir, h);
+
+            // "/static" as well as "/static/"
+            if (dir.size() > 1)
+                mRouter.add(dir.substr(0, dir.size() - 1), h);
         }
-#endif
     }
+}
 
-    return true;
+HttpRouteMetrics::Shard &HttpRouteMetrics::threadShard() noexcept {
+    static std::atomic<unsigned> nextShard{0};
+    thread_local unsigned shard = nextShard.fetch_add(1, std::memory_order_relaxed) % TINYHTTP_METRICS_SHARDS;
+
+    return mShards[shard];
 }
 
-/*static*/ bool HttpHandlerBuilder::isSafeFilename(const std::string &name, bool allowSlash) {
-    static const char allowedChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-+@";
-    for (auto x : name) {
-        if (x == '/' && !allowSlash)
-            return false;
+void HttpRouteMetrics::record(unsigned statusCode, uint64_t bytesIn, uint64_t bytesOut, std::chrono::steady_clock::duration latency) noexcept {
+    Shard &shard = threadShard();
 
-        bool ok = false;
-        for (size_t i = 0; allowedChars[i] && !ok; i++)
-            ok = allowedChars[i] == x;
+    // Every bucket ends at twice the previous one, so it is the bit width of the latency in first buckets
+    uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    uint64_t steps  = (micros + kFirstBucketMicros - 1) / kFirstBucketMicros;
+    unsigned bucket = steps <= 1 ? 0 : std::min<unsigned>(std::bit_width(steps - 1), kLatencyBuckets);
 
-        if (!ok) return false;
+    shard.statusClasses[std::clamp(statusCode / 100, 1u, 5u) - 1].fetch_add(1, std::memory_order_relaxed);
+    shard.bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+    shard.bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+    shard.latencyMicros.fetch_add(micros, std::memory_order_relaxed);
+    shard.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void HttpRouteMetrics::addBytesOut(uint64_t bytes) noexcept {
+    threadShard().bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+HttpRouteMetrics::Totals HttpRouteMetrics::collect() const noexcept {
+    Totals totals;
+
+    for (auto &shard : mShards) {
+        for (size_t i = 0; i < std::size(totals.statusClasses); i++)
+            totals.statusClasses[i] += shard.statusClasses[i].load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < std::size(totals.latency); i++)
+            totals.latency[i] += shard.latency[i].load(std::memory_order_relaxed);
+
+        totals.bytesIn += shard.bytesIn.load(std::memory_order_relaxed);
+        totals.bytesOut += shard.bytesOut.load(std::memory_order_relaxed);
+        totals.latencyMicros += shard.latencyMicros.load(std::memory_order_relaxed);
     }
 
-    return true;
+    return totals;
+}
+
+void HttpServer::addRouteLabel(std::string label, HandlerBuilder &handler) {
+    if (mMetrics)
+        handler.metrics = &routeMetrics(label);
+
+    mRouteLabels.push_back({std::move(label), &handler});
 }
 
-/*static*/ std::string HttpHandlerBuilder::getMimeType(std::string name) {
-    static std::map<std::string, std::string> mMimeDatabase;
+HttpRouteMetrics &HttpServer::routeMetrics(const std::string &label) {
+    for (auto &route : mMetrics->routes)
+        if (route.route() == label)
+            return route;
 
-    if (mMimeDatabase.empty()) {
-        mMimeDatabase.insert({"js", "application/javascript"});
-        mMimeDatabase.insert({"pdf", "application/pdf"});
-        mMimeDatabase.insert({"gz", "application/gzip"});
-        mMimeDatabase.insert({"xml", "application/xml"});
-        mMimeDatabase.insert({"html", "text/html"});
-        mMimeDatabase.insert({"htm", "text/html"});
-        mMimeDatabase.insert({"css", "text/css"});
-        mMimeDatabase.insert({"txt", "text/plain"});
-        mMimeDatabase.insert({"png", "image/png"});
-        mMimeDatabase.insert({"jpg", "image/jpeg"});
-        mMimeDatabase.insert({"jpeg", "image/jpeg"});
-        mMimeDatabase.insert({"json", "application/json"});
+    return mMetrics->routes.emplace_back(label);
+}
+
+std::shared_ptr<HttpHandlerBuilder> HttpServer::enableMetrics(std::string path) {
+    if (!mMetrics) {
+        mMetrics = std::make_unique<Metrics>();
+
+        for (auto &[label, handler] : mRouteLabels)
+            handler->metrics = &routeMetrics(label);
     }
 
-    size_t pos = name.rfind(".");
-    if (pos == std::string::npos)
-        return "application/octet-stream";
+    auto h = when(std::move(path));
+    h->requested([this](const HttpRequest &) {
+        return HttpResponse{200, "text/plain; version=0.0.4; charset=utf-8", renderMetrics()};
+    });
+
+    return h;
+}
+
+// Starts a series of the route, the caller adds further labels and closes the braces
+static void appendRouteLabel(std::string &out, std::string_view name, std::string_view route) {
+    out += name;
+    out += "{route=\"";
+
+    for (char ch : route) {
+        if (ch == '\n') {
+            out += "\\n";
+            continue;
+        }
 
-    auto f = mMimeDatabase.find(name.substr(pos + 1));
-    if (f == mMimeDatabase.end())
-        return "application/octet-stream";
+        if (ch == '\\' || ch == '"')
+            out += '\\';
+        out += ch;
+    }
 
-    return f->second;
+    out += '"';
 }
 
-HttpServer::Processor::Processor(std::shared_ptr<IClientStream> stream, HttpServer &owner)
-    : mClientStream{std::move(stream)}, mOwner{owner}, mLastActive{std::chrono::system_clock::now()},
-      mIsAlive{true}, mHasHandover{false} {}
+std::string HttpServer::renderMetrics() {
+    std::vector<std::pair<const HttpRouteMetrics *, HttpRouteMetrics::Totals>> routes;
 
-/* static */ void HttpServer::Processor::clientThreadProc(std::shared_ptr<Processor> self) {
-    ICanRequestProtocolHandover *handover = nullptr;
-    std::unique_ptr<HttpRequest> handoverRequest;
+    // Routes without requests are left out, there are usually plenty of them
+    auto add = [&](const HttpRouteMetrics &route) {
+        auto totals = route.collect();
+        for (uint64_t count : totals.statusClasses)
+            if (count > 0) {
+                routes.push_back({&route, totals});
+                break;
+            }
+    };
 
-    try {
-        while (self->mClientStream->isOpen() && self->isAlive()) {
-            HttpRequest req;
+    for (auto &route : mMetrics->routes)
+        add(route);
+    add(mMetrics->unmatched);
 
-            try {
-                if (!req.parse(self->mClientStream)) {
-                    self->mClientStream->send(self->mOwner.mDefault400Message);
-                    self->mClientStream->close();
-                    continue;
-                }
-            } catch (...) {
-                self->mClientStream->send(self->mOwner.mDefault400Message);
-                self->mClientStream->close();
+    std::string out;
+    char number[32];
+
+    out += "# HELP tinyhttp_requests_total Requests answered, by route and status class.\n"
+           "# TYPE tinyhttp_requests_total counter\n";
+    for (auto &[route, totals] : routes)
+        for (size_t i = 0; i < std::size(totals.statusClasses); i++) {
+            if (totals.statusClasses[i] == 0)
                 continue;
-            }
 
-            auto res = self->mOwner.processRequest(req.getPath(), req);
-            if (res) {
-#ifndef TINYHTTP_ALLOW_KEEPALIVE
-                (*res)["Connection"] = "close";
-#endif
+            appendRouteLabel(out, "tinyhttp_requests_total", route->route());
+            out += ",status=\"" + std::to_string(i + 1) + "xx\"} " + std::to_string(totals.statusClasses[i]) + "\n";
+        }
 
-                auto builtMessage = res->buildMessage();
-                self->mClientStream->send(builtMessage);
+    out += "# HELP tinyhttp_received_bytes_total Request heads and bodies received, by route.\n"
+           "# TYPE tinyhttp_received_bytes_total counter\n";
+    for (auto &[route, totals] : routes) {
+        appendRouteLabel(out, "tinyhttp_received_bytes_total", route->route());
+        out += "} " + std::to_string(totals.bytesIn) + "\n";
+    }
 
-                if (res->acceptProtocolHandover(&handover)) {
-                    handoverRequest = std::make_unique<HttpRequest>(req);
-                    break;
-                }
+    out += "# HELP tinyhttp_sent_bytes_total Responses sent, by route.\n"
+           "# TYPE tinyhttp_sent_bytes_total counter\n";
+    for (auto &[route, totals] : routes) {
+        appendRouteLabel(out, "tinyhttp_sent_bytes_total", route->route());
+        out += "} " + std::to_string(totals.bytesOut) + "\n";
+    }
 
-                goto keep_alive_check;
-            }
+    out += "# HELP tinyhttp_request_duration_seconds Time from the parsed request head until the response was queued, by route.\n"
+           "# TYPE tinyhttp_request_duration_seconds histogram\n";
+    for (auto &[route, totals] : routes) {
+        uint64_t count = 0;
 
-            self->mClientStream->send(self->mOwner.mDefault404Message);
+        for (unsigned i = 0; i <= HttpRouteMetrics::kLatencyBuckets; i++) {
+            count += totals.latency[i];
 
-        keep_alive_check:
-            self->mLastActive = std::chrono::system_clock::now();
+            if (i < HttpRouteMetrics::kLatencyBuckets)
+                snprintf(number, sizeof(number), "%g", HttpRouteMetrics::kFirstBucketMicros * 1e-6 * (1u << i));
+            else
+                strcpy(number, "+Inf");
 
-#ifdef TINYHTTP_ALLOW_KEEPALIVE
-            if (req["Connection"] != "keep-alive")
-                break;
+            appendRouteLabel(out, "tinyhttp_request_duration_seconds_bucket", route->route());
+            out += ",le=\"" + std::string{number} + "\"} " + std::to_string(count) + "\n";
+        }
+
+        snprintf(number, sizeof(number), "%.6f", totals.latencyMicros * 1e-6);
+        appendRouteLabel(out, "tinyhttp_request_duration_seconds_sum", route->route());
+        out += "} " + std::string{number} + "\n";
+        appendRouteLabel(out, "tinyhttp_request_duration_seconds_count", route->route());
+        out += "} " + std::to_string(count) + "\n";
+    }
+
+#ifdef TINYHTTP_THREADING
+    size_t connections;
+    {
+        std::lock_guard lock{mProcessorListMutex};
+        connections = mProcessors.size();
+    }
 #else
-            break;
+    size_t connections = mCurrentProcessor && mCurrentProcessor->isAlive() ? 1 : 0;
 #endif
-        }
 
-        if (handover) {
-            puts("Doing handover");
-            self->mHasHandover = true;
-            handover->acceptHandover(self->mOwner.mSocket, *self->mClientStream.get(), std::move(handoverRequest));
-            puts("Handover proc exited");
-        }
-    } catch (std::exception &e) {
-        // Don't print the exception when we are getting shut down, it's expected to be raised
-        if (self->isAlive()) {
-            std::cerr << "Exception in HTTP client handler (" << e.what() << ")\n";
-        }
+    out += "# HELP tinyhttp_open_connections Client connections that are open, handed over ones included.\n"
+           "# TYPE tinyhttp_open_connections gauge\n"
+           "tinyhttp_open_connections " +
+           std::to_string(connections) + "\n";
+
+    out += "# HELP tinyhttp_active_handovers Connections handed over to another protocol, like websockets.\n"
+           "# TYPE tinyhttp_active_handovers gauge\n"
+           "tinyhttp_active_handovers " +
+           std::to_string(mActiveHandovers.load()) + "\n";
+
+#ifdef TINYHTTP_REACTOR
+    std::shared_ptr<Reactor> reactor;
+    {
+        std::lock_guard lock{mReactorMutex};
+        reactor = mReactor.lock();
     }
 
-    self->mClientStream->close();
-    self->mIsAlive = false;
+    if (reactor)
+        out += "# HELP tinyhttp_worker_queue_depth Connections waiting for a worker.\n"
+               "# TYPE tinyhttp_worker_queue_depth gauge\n"
+               "tinyhttp_worker_queue_depth " +
+               std::to_string(reactor->queueDepth()) + "\n";
+#endif
+
+    return out;
 }
 
-bool HttpServer::Processor::isTimedOut() const noexcept {
-    if constexpr (TINYHTTP_CLIENT_TIMEOUT <= 0) {
-        return false;
+#ifdef TINYHTTP_TRACING
+std::shared_ptr<HttpHandlerBuilder> HttpServer::enableTracing(std::string path, bool serverTiming) {
+    if (!mTraceLog) {
+        mTraceLog = std::make_unique<TraceLog>();
+        mTraceLog->slowest.reserve(TINYHTTP_TRACE_LOG_SIZE);
     }
 
-    if (mHasHandover) {
-        return false;
-    }
+    mTraceLog->serverTiming = serverTiming;
 
-    auto duration = std::chrono::system_clock::now() - mLastActive;
-    return duration > std::chrono::seconds(TINYHTTP_CLIENT_TIMEOUT);
+    auto h = when(std::move(path));
+    h->requested([this](const HttpRequest &) { return HttpResponse{200, "application/json", renderTraces()}; });
+    h->posted([this](const HttpRequest &req) {
+        clearTraces();
+        return HttpResponse{200};
+    });
+
+    return h;
 }
 
-void HttpServer::Processor::shutdown() {
+// Orders the log as a heap with the fastest trace on top
+static bool isSlowerTrace(const HttpTrace &a, const HttpTrace &b) noexcept {
+    return a.totalNanos > b.totalNanos;
+}
+
+void HttpServer::logTrace(const HttpTrace &trace) {
+    TraceLog &log = *mTraceLog;
+
+    // Once the log is full most requests are too fast for it, which is found out without the lock
+    if (trace.totalNanos / 1000 < log.thresholdMicros.load(std::memory_order_relaxed))
+        return;
+
 #ifdef TINYHTTP_THREADING
-    std::unique_lock{mShutdownMutex};
+    std::lock_guard lock{log.mutex};
 #endif
 
-    mIsAlive = false;
+    if (log.slowest.size() < TINYHTTP_TRACE_LOG_SIZE) {
+        log.slowest.push_back(trace);
+    } else if (isSlowerTrace(trace, log.slowest.front())) {
+        std::pop_heap(log.slowest.begin(), log.slowest.end(), isSlowerTrace);
+        log.slowest.back() = trace;
+    } else {
+        return;
+    }
 
-    if (mClientStream && mClientStream->isOpen())
-        mClientStream->close();
+    std::push_heap(log.slowest.begin(), log.slowest.end(), isSlowerTrace);
 
+    if (log.slowest.size() == TINYHTTP_TRACE_LOG_SIZE)
+        log.thresholdMicros = static_cast<uint32_t>(std::min<uint64_t>(log.slowest.front().totalNanos / 1000, UINT32_MAX));
+}
+
+void HttpServer::clearTraces() {
 #ifdef TINYHTTP_THREADING
-    if (mWorkThread && mWorkThread->joinable())
-        mWorkThread->detach();
+    std::lock_guard lock{mTraceLog->mutex};
 #endif
+
+    mTraceLog->slowest.clear();
+    mTraceLog->thresholdMicros = 0;
 }
 
+std::string HttpServer::renderTraces() {
+    static const char *const methodNames[] = {"GET", "POST", "PUT", "DELETE", "OPTIONS", "UNKNOWN"};
+
+    std::vector<HttpTrace> traces;
+    {
 #ifdef TINYHTTP_THREADING
-void HttpServer::Processor::startThread() {
-    auto self_ptr = shared_from_this();
-    mWorkThread.reset(new std::thread{[self_ptr]() {
-        clientThreadProc(self_ptr);
-    }});
-}
+        std::lock_guard lock{mTraceLog->mutex};
+#endif
+        traces = mTraceLog->slowest;
+    }
 
-void HttpServer::cleanupThreadProc() {
-    while (!mCleanupThreadShutdown) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::sort(traces.begin(), traces.end(), isSlowerTrace);
 
-        if (mSocket == -1)
-            continue;
+    // Traces only have the steady clock, which doesn't tell the time of day
+    auto steadyNow = std::chrono::steady_clock::now();
+    auto systemNow = std::chrono::system_clock::now();
 
-        mRequestProcessorListMutex.lock();
-        for (auto it = mRequestProcessors.begin(); it != mRequestProcessors.end(); ++it) {
-            auto &processor = *it;
+    std::string out = "[";
+    char number[32];
 
-            if (processor->isTimedOut()) {
-                processor->shutdown();
-            }
+    for (auto &trace : traces) {
+        auto startedAt = systemNow - std::chrono::duration_cast<std::chrono::system_clock::duration>(steadyNow - trace.start);
 
-            if (!processor->isAlive()) {
-                mRequestProcessors.erase(it);
-                it = mRequestProcessors.begin();
+        if (out.size() > 1)
+            out += ",";
+
+        out += "\n{\"method\":\"";
+        out += methodNames[static_cast<size_t>(trace.method)];
+        out += "\",\"path\":\"";
+
+        for (char ch : std::string_view{trace.path, trace.pathLength}) {
+            if (ch == '"' || ch == '\\')
+                out += '\\';
+
+            if (static_cast<unsigned char>(ch) < 0x20) {
+                snprintf(number, sizeof(number), "\\u%04x", static_cast<unsigned>(ch));
+                out += number;
+            } else {
+                out += ch;
             }
         }
-        mRequestProcessorListMutex.unlock();
+
+        out += "\",\"status\":" + std::to_string(trace.statusCode);
+        out += ",\"time\":" + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(startedAt.time_since_epoch()).count());
+
+        snprintf(number, sizeof(number), "%.1f", trace.totalNanos / 1e3);
+        out += ",\"totalMicros\":" + std::string{number} + ",\"phaseMicros\":{";
+
+        for (unsigned phase = 0; phase < HttpTrace::PHASE_COUNT; phase++) {
+            snprintf(number, sizeof(number), "%.1f", trace.nanos[phase] / 1e3);
+            out += std::string{phase > 0 ? "," : ""} + "\"" + HttpTrace::kPhaseNames[phase] + "\":" + number;
+        }
+
+        out += "}}";
     }
+
+    out += "\n]\n";
+    return out;
 }
 #endif
 
 HttpServer::HttpServer() {
-    mDefault404Message = HttpResponse{404, "text/plain", "404 not found"}.buildMessage();
-    mDefault400Message = HttpResponse{400, "text/plain", "400 bad request"}.buildMessage();
+    auto prebuilt = [](unsigned statusCode, const char *message) {
+        return std::make_shared<HttpResponse>(HttpResponse::prebuilt(
+                statusCode, std::make_shared<const MessageBuilder>(HttpResponse{statusCode, "text/plain", message}.buildMessage())));
+    };
 
-#ifdef TINYHTTP_THREADING
-    mCleanupThread.reset(new std::thread{[this]() { this->cleanupThreadProc(); }});
-#endif
-}
+    mDefault400Response = prebuilt(400, "400 bad request");
+    mDefault413Response = prebuilt(413, "413 content too large");
+    mDefault500Response = prebuilt(500, "500 exception while processing");
 
-void HttpServer::startListening(uint16_t port) {
-    if (mSocket != -1)
-        throw std::runtime_error("Server is already running");
+    // Queued as it is, without going through respond()
+    HttpResponse notFound{404, "text/plain", "404 not found"};
+#ifndef TINYHTTP_ALLOW_KEEPALIVE
+    notFound[HttpHeader::CONNECTION] = "close";
+#endif
+    mDefault404Message = notFound.buildMessage();
 
-    mSocket = socket(AF_INET, SOCK_STREAM, 0);
+    // Sent by the reactor when no worker can take a request
+    HttpResponse busy{503, "text/plain", "503 server busy"};
+    busy[HttpHeader::CONNECTION] = "close";
+    busy["Retry-After"]          = "1";
+    mDefault503Message           = busy.buildMessage();
+}
 
-    if (mSocket == -1)
-        throw std::runtime_error("Could not create socket");
+static void sleepMilliseconds(unsigned ms) {
+#ifdef TINYHTTP_THREADING
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+#else
+    usleep(ms * 1000);
+#endif
+}
 
+// Binds sock to port on every interface and starts listening, retries until the port is free
+static void setUpListenSocket(int sock, uint16_t port, int backlog, bool reusePort) {
     int opt = 1;
-    if (setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("setsockopt");
         throw std::runtime_error("Could not set SO_REUSEADDR option");
     }
 
+#ifdef SO_REUSEPORT
+    if (reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        throw std::runtime_error("Could not set SO_REUSEPORT option");
+    }
+#endif
+
     struct sockaddr_in remote = {};
 
     remote.sin_family      = AF_INET;
@@ -348,40 +3314,162 @@ void HttpServer::startListening(uint16_t port) {
     int iRetval;
 
     while (true) {
-        iRetval = bind(mSocket, reinterpret_cast<struct sockaddr *>(&remote), sizeof(remote));
+        iRetval = bind(sock, reinterpret_cast<struct sockaddr *>(&remote), sizeof(remote));
 
         if (iRetval < 0) {
             perror("Failed to bind socket, retrying in 5 seconds...");
-#ifdef TINYHTTP_THREADING
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-#else
-            usleep(5000 * 1000);
-#endif
+            sleepMilliseconds(5000);
         } else
             break;
     }
 
-    iRetval = ::listen(mSocket, 3);
+    iRetval = ::listen(sock, backlog);
     if (iRetval < 0)
         throw std::runtime_error("listen() failed");
+}
 
-    printf("Waiting for incoming connections...\n");
-    while (mSocket != -1) {
-        auto processor = std::make_shared<Processor>(
-                std::make_shared<TCPClientStream>(TCPClientStream::acceptFrom(mSocket)),
-                *this);
+void HttpServer::startListening(uint16_t port, HttpListenOptions options) {
+    if (mSocket != -1)
+        throw std::runtime_error("Server is already running");
+
+    mSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (mSocket == -1)
+        throw std::runtime_error("Could not create socket");
+
+    int listener = mSocket;
+
+#if defined(TINYHTTP_THREADING) && defined(SO_REUSEPORT)
+    unsigned acceptThreads = std::max(options.acceptThreads, 1u);
+#else
+    // Without SO_REUSEPORT there is nothing to spread the connections over
+    unsigned acceptThreads = 1;
+#endif
+
+    setUpListenSocket(listener, port, options.backlog, acceptThreads > 1);
+
+    // Every accept thread gets its own socket on the same port, the kernel balances the
+    // connections between them so a burst isn't queued behind a single accept() loop
+    for (unsigned i = 1; i < acceptThreads; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        try {
+            if (sock == -1)
+                throw std::runtime_error("Could not create socket");
+
+            setUpListenSocket(sock, port, options.backlog, true);
+        } catch (std::exception &e) {
+            fprintf(stderr, "Could not start accept thread: %s\n", e.what());
+            if (sock != -1)
+                close(sock);
+            break;
+        }
 
 #ifdef TINYHTTP_THREADING
-        processor->startThread();
+        std::lock_guard lock{mAcceptorMutex};
+#endif
+        mAcceptorSockets.push_back(sock);
+    }
+
+#ifdef TINYHTTP_REACTOR
+    std::shared_ptr<Reactor> reactor;
+
+    if (mUseReactor)
+        reactor = std::make_shared<Reactor>(TINYHTTP_IO_THREADS, TINYHTTP_WORKER_THREADS, TINYHTTP_WORKER_QUEUE_SIZE);
+
+    {
+        std::lock_guard lock{mReactorMutex};
+        mReactor = reactor;
+    }
+#endif
+
+    // Once the process is out of descriptors the pending connection stays in the queue and
+    // accept() fails right away again. A spare descriptor is kept to make room for taking it
+    // off the queue and closing it, then the loop backs off until descriptors are freed
+    auto acceptLoop = [&](int listenSocket) {
+        int reserve        = socket(AF_INET, SOCK_DGRAM, 0);
+        unsigned backoffMs = 0;
+
+        while (mSocket != -1) {
+            TCPClientStream stream = TCPClientStream::acceptFrom(listenSocket);
+
+            if (!stream.isOpen()) {
+                int error = errno;
+
+                if (mSocket == -1)
+                    break;
+
+                if (error == EINTR || error == ECONNABORTED)
+                    continue;
 
-        mRequestProcessorListMutex.lock();
-        mRequestProcessors.push_back(std::move(processor));
-        mRequestProcessorListMutex.unlock();
+                if (backoffMs == 0) {
+                    errno = error;
+                    perror("accept failed");
+                }
+
+                if (error == EMFILE || error == ENFILE) {
+                    if (reserve >= 0)
+                        close(reserve);
+
+                    int sock = accept(listenSocket, nullptr, nullptr);
+                    if (sock >= 0)
+                        close(sock);
+
+                    reserve = socket(AF_INET, SOCK_DGRAM, 0);
+                }
+
+                backoffMs = std::min(std::max(backoffMs * 2, 10u), 1000u);
+                sleepMilliseconds(backoffMs);
+                continue;
+            }
+
+            backoffMs = 0;
+
+            auto processor = std::make_shared<Processor>(std::make_shared<TCPClientStream>(std::move(stream)), *this);
+
+#ifdef TINYHTTP_THREADING
+#ifdef TINYHTTP_REACTOR
+            if (reactor)
+                reactor->attach(std::move(processor));
+            else
+#endif
+                processor->startThread();
 #else
-        mCurrentProcessor = processor;
-        Processor::clientThreadProc(processor);
+            mCurrentProcessor = processor;
+            Processor::clientThreadProc(processor);
 #endif
+        }
+
+        if (reserve >= 0)
+            close(reserve);
+    };
+
+    printf("Waiting for incoming connections...\n");
+
+#ifdef TINYHTTP_THREADING
+    std::vector<std::thread> acceptors;
+    for (int sock : mAcceptorSockets)
+        acceptors.emplace_back(acceptLoop, sock);
+
+    acceptLoop(listener);
+
+    for (auto &thread : acceptors)
+        thread.join();
+
+    {
+        std::lock_guard lock{mAcceptorMutex};
+        for (int sock : mAcceptorSockets)
+            close(sock);
+        mAcceptorSockets.clear();
     }
+#else
+    acceptLoop(listener);
+#endif
+
+#ifdef TINYHTTP_REACTOR
+    if (reactor)
+        reactor->stop();
+#endif
 
     puts("Listen loop exited");
 }
@@ -396,12 +3484,23 @@ void HttpServer::shutdown() {
     mSocket = -1;
 
     puts("Shutting down server");
+
+#ifdef TINYHTTP_THREADING
+    {
+        std::lock_guard lock{mAcceptorMutex};
+        for (int acceptor : mAcceptorSockets)
+            ::shutdown(acceptor, SHUT_RDWR);
+    }
+#endif
+
     ::shutdown(sock, SHUT_RDWR);
 
 #ifdef TINYHTTP_THREADING
-    mRequestProcessorListMutex.lock();
-    mRequestProcessors.clear();
-    mRequestProcessorListMutex.unlock();
+    {
+        std::lock_guard lock{mProcessorListMutex};
+        for (auto processor : mProcessors)
+            processor->interrupt();
+    }
 #else
     if (mCurrentProcessor) {
         mCurrentProcessor->shutdown();
@@ -2,7 +2,15 @@
 #define HTTP_SERVER_H
 
 // wii u doesnt have this?
+#ifdef __WIIU__
 #define MSG_NOSIGNAL 0
+#endif
+
+// send response heads and bodies with a single sendmsg() call
+// (not used with the wii u socket library)
+#ifndef __WIIU__
+#define TINYHTTP_GATHER_IO
+#endif
 
 
 // json support (Currently uses MiniJson)
@@ -17,14 +25,78 @@
 // threading support
 #define TINYHTTP_THREADING
 
+// event-driven I/O: a fixed set of I/O threads polls the connections and hands
+// ready ones to a bounded worker pool, instead of running a thread per client
+// (can be turned off at runtime with HttpServer::setReactorEnabled)
+#define TINYHTTP_REACTOR
+
+// gzip/deflate response compression for routes that ask for it (needs zlib)
+#define TINYHTTP_COMPRESSION
+
 // allow keep-alive connections
 // (you should disable this if you are using a single thread)
 #define TINYHTTP_ALLOW_KEEPALIVE
 
+// time every phase of a request and keep the slowest ones, see HttpServer::enableTracing
+// (costs a few clock reads per request)
+//#define TINYHTTP_TRACING
+
+#if defined(TINYHTTP_REACTOR) && !defined(TINYHTTP_THREADING)
+#error "TINYHTTP_REACTOR requires TINYHTTP_THREADING"
+#endif
+
+#ifndef TINYHTTP_IO_THREADS
+#define TINYHTTP_IO_THREADS (1)
+#endif
+
+#ifndef TINYHTTP_WORKER_THREADS
+#define TINYHTTP_WORKER_THREADS (4)
+#endif
+
+// Threads that run the blocking calls coroutine handlers pass to offloadBlocking()
+#ifndef TINYHTTP_BLOCKING_THREADS
+#define TINYHTTP_BLOCKING_THREADS (2)
+#endif
+
+// Copies of every route's request counters, threads beyond that share them
+#ifndef TINYHTTP_METRICS_SHARDS
+#define TINYHTTP_METRICS_SHARDS (8)
+#endif
+
+// Requests that arrive while this many are waiting for a worker are answered with a 503
+#ifndef TINYHTTP_WORKER_QUEUE_SIZE
+#define TINYHTTP_WORKER_QUEUE_SIZE (64)
+#endif
+
+// Connections the kernel queues until they are accepted
+#ifndef TINYHTTP_LISTEN_BACKLOG
+#define TINYHTTP_LISTEN_BACKLOG (16)
+#endif
+
+// Threads accepting connections, more than one needs SO_REUSEPORT
+#ifndef TINYHTTP_ACCEPT_THREADS
+#define TINYHTTP_ACCEPT_THREADS (1)
+#endif
+
+#ifndef TINYHTTP_READ_BUFFER_SIZE
+#define TINYHTTP_READ_BUFFER_SIZE (4 * 1024) // 4kiB, per connection
+#endif
+
+// Responses and their headers are made in this much memory of the connection, released after
+// every batch of requests. More than that comes from the heap until the batch was answered
+#ifndef TINYHTTP_ARENA_SIZE
+#define TINYHTTP_ARENA_SIZE (2 * 1024) // 2kiB, per connection
+#endif
+
 #ifndef MAX_HTTP_HEADERS
 #define MAX_HTTP_HEADERS 30
 #endif
 
+// Request line and headers have to fit in a single read buffer
+#ifndef MAX_HTTP_HEAD_SIZE
+#define MAX_HTTP_HEAD_SIZE TINYHTTP_READ_BUFFER_SIZE
+#endif
+
 #ifndef MAX_HTTP_CONTENT_SIZE
 #define MAX_HTTP_CONTENT_SIZE (50 * 1024) // 50kiB
 #endif
@@ -33,8 +105,66 @@
 #define MAX_ALLOWED_WS_FRAME_LENGTH (50 * 1024) // 50kiB
 #endif
 
+// Without gather I/O, bodies up to this size are sent in the same write as the head
+#ifndef TINYHTTP_SEND_COALESCE_SIZE
+#define TINYHTTP_SEND_COALESCE_SIZE (1400) // about one TCP segment
+#endif
+
+// Pipelined requests that are answered with a single write at most
+#ifndef TINYHTTP_PIPELINE_DEPTH
+#define TINYHTTP_PIPELINE_DEPTH (16)
+#endif
+
+// Output the client doesn't take right away is queued on its connection. Streamed bodies and
+// websocket senders wait once more than the high watermark is queued, until it drained below the low one.
+// Topics don't wait, they close subscribers that are that far behind
+#ifndef TINYHTTP_OUTPUT_HIGH_WATERMARK
+#define TINYHTTP_OUTPUT_HIGH_WATERMARK (64 * 1024) // 64kiB, per connection
+#endif
+
+#ifndef TINYHTTP_OUTPUT_LOW_WATERMARK
+#define TINYHTTP_OUTPUT_LOW_WATERMARK (16 * 1024) // 16kiB
+#endif
+
+// Response bodies up to this size are copied next to their head when responses are batched
+#ifndef TINYHTTP_INLINE_BODY_SIZE
+#define TINYHTTP_INLINE_BODY_SIZE (512)
+#endif
+
+// Streamed response bodies are collected into chunks of about this size before they are sent
+#ifndef TINYHTTP_CHUNK_SIZE
+#define TINYHTTP_CHUNK_SIZE (4 * 1024) // 4kiB
+#endif
+
+// Bytes of file content kept in memory by serveFile() and serveFromFolder(), files larger
+// than a quarter of it are read for every request
+#ifndef TINYHTTP_FILE_CACHE_SIZE
+#define TINYHTTP_FILE_CACHE_SIZE (512 * 1024) // 512kiB
+#endif
+
+// Paths a route with cacheFor() keeps responses for, each query counts as a path of its own.
+// Routes with parameters can match any number of them, a path beyond this is answered by
+// the handler every time
+#ifndef TINYHTTP_CACHE_MAX_PATHS
+#define TINYHTTP_CACHE_MAX_PATHS (64)
+#endif
+
+// Buffered bodies smaller than this aren't worth compressing, headers and a segment cost more
+#ifndef TINYHTTP_COMPRESS_MIN_SIZE
+#define TINYHTTP_COMPRESS_MIN_SIZE (1024) // 1kiB
+#endif
+
+// zlib level and window, with a 8kiB window the deflate state each thread keeps is about 70kiB
+#ifndef TINYHTTP_COMPRESS_LEVEL
+#define TINYHTTP_COMPRESS_LEVEL (6)
+#endif
+
+#ifndef TINYHTTP_COMPRESS_WINDOW_BITS
+#define TINYHTTP_COMPRESS_WINDOW_BITS (13)
+#endif
+
 #ifndef WS_FRAGMENT_THRESHOLD
-#define WS_FRAGMENT_THRESHOLD (2 * 1024) // 2kiB
+#define WS_FRAGMENT_THRESHOLD (0) // default for setFragmentSize(), 0 sends every message as one frame
 #endif
 
 // Disabled if set to a <= 0 value
@@ -44,23 +174,67 @@
 #define TINYHTTP_CLIENT_TIMEOUT (30) // Seconds
 #endif
 
+// Disabled if set to a <= 0 value
+// Time a client gets to send a whole request head, and then its body
+#ifndef TINYHTTP_HEADER_TIMEOUT
+#define TINYHTTP_HEADER_TIMEOUT (10) // Seconds
+#endif
+
+#ifndef TINYHTTP_BODY_TIMEOUT
+#define TINYHTTP_BODY_TIMEOUT (30) // Seconds
+#endif
+
+// Time a client gets to take any of the output that is waiting for it
+#ifndef TINYHTTP_SEND_TIMEOUT
+#define TINYHTTP_SEND_TIMEOUT (30) // Seconds
+#endif
+
+// Resolution of the timeouts above
+#ifndef TINYHTTP_TIMER_TICK
+#define TINYHTTP_TIMER_TICK (100) // Milliseconds
+#endif
+
+// Requests HttpServer::enableTracing keeps, the slowest ones win
+#ifndef TINYHTTP_TRACE_LOG_SIZE
+#define TINYHTTP_TRACE_LOG_SIZE (32)
+#endif
+
+// Longer request paths are cut off in traces
+#ifndef TINYHTTP_TRACE_PATH_SIZE
+#define TINYHTTP_TRACE_PATH_SIZE (64)
+#endif
+
 #include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <coroutine>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <regex>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <sys/socket.h>
 #ifdef TINYHTTP_THREADING
+#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <thread>
 #endif
@@ -74,7 +248,11 @@
 #endif
 
 // use custom endian.h for wii u
+#ifdef __WIIU__
 #include "../utils/endian.h"
+#else
+#include <endian.h>
+#endif
 
 enum class HttpRequestMethod { GET,
                                POST,
@@ -83,6 +261,69 @@ enum class HttpRequestMethod { GET,
                                OPTIONS,
                                UNKNOWN };
 
+// Headers the server itself looks at, these are matched by id instead of by name
+enum class HttpHeader : uint8_t {
+    OTHER,
+    ACCEPT_ENCODING,
+    ACCEPT_RANGES,
+    CONNECTION,
+    CONTENT_ENCODING,
+    CONTENT_LENGTH,
+    CONTENT_RANGE,
+    CONTENT_TYPE,
+    ETAG,
+    HOST,
+    IF_MODIFIED_SINCE,
+    IF_NONE_MATCH,
+    IF_RANGE,
+    LAST_MODIFIED,
+    RANGE,
+    SEC_WEBSOCKET_ACCEPT,
+    SEC_WEBSOCKET_EXTENSIONS,
+    SEC_WEBSOCKET_KEY,
+    SERVER,
+    TRANSFER_ENCODING,
+    UPGRADE,
+    VARY,
+};
+
+// Case-insensitive FNV-1a, header names are hashed once when they are parsed or stored
+constexpr uint32_t hashHttpHeaderName(std::string_view name) noexcept {
+    uint32_t hash = 2166136261u;
+
+    for (char ch : name) {
+        hash ^= static_cast<uint8_t>((ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+inline bool equalsHttpHeaderName(std::string_view a, std::string_view b) noexcept {
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++)
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+            return false;
+
+    return true;
+}
+
+HttpHeader identifyHttpHeader(std::string_view name, uint32_t hash) noexcept;
+std::string_view httpHeaderName(HttpHeader id) noexcept;
+
+// Whether an Accept-Encoding value allows a content coding, "q=0" refuses it and "*" stands in
+// for codings that aren't listed
+bool acceptsHttpEncoding(std::string_view acceptEncoding, std::string_view coding) noexcept;
+
+enum class ContentCoding : uint8_t { IDENTITY,
+                                     GZIP,
+                                     DEFLATE };
+
+// The coding a response should use for an Accept-Encoding value, gzip is preferred
+ContentCoding negotiateContentCoding(std::string_view acceptEncoding) noexcept;
+
 #ifdef TINYHTTP_WS
 enum {
     WSOPC_CONTINUATION = 0x0,
@@ -102,8 +343,31 @@ enum {
     WSOPC_CTRL_RES3    = 0xE,
     WSOPC_CTRL_RES4    = 0xF,
 };
+
+// Status codes sent in a close frame
+enum {
+    WSCLOSE_PROTOCOL_ERROR = 1002,
+};
+
+// XORs length bytes of in with the 4-byte masking key, as the first bytes of a payload. Works a vector or
+// word at a time, in and out may be unaligned and may be the same buffer
+void maskWebsockPayload(uint8_t *out, const uint8_t *in, size_t length, const uint8_t key[4]) noexcept;
 #endif
 
+// One piece of a gathered write, only referenced until the send returns. Whatever has to wait for
+// the client is copied into the output queue, unless an owner keeps the data alive: then the queue
+// holds on to the owner instead
+struct SendSlice {
+    const void *data;
+    size_t size;
+    std::shared_ptr<const void> owner{};
+
+    // For data that outlives every connection, like string literals, queued without owning anything
+    static std::shared_ptr<const void> staticOwner(const void *data) noexcept {
+        return {std::shared_ptr<const void>{}, data};
+    }
+};
+
 struct IClientStream {
     virtual ~IClientStream()                                                = default;
     virtual bool isOpen() noexcept                                          = 0;
@@ -112,6 +376,59 @@ struct IClientStream {
     virtual std::string receiveLine(bool asciiOnly = true, size_t max = -1) = 0;
     virtual void close()                                                    = 0;
 
+    // Reads a request line and its headers up to and including the empty line,
+    // the view stays valid until the next read from the stream
+    virtual std::string_view receiveHead(size_t max) = 0;
+
+    // Reads what arrived without waiting, for receiveHead() to find. Returns how much, 0 if nothing arrived yet.
+    // Throws once the client closed the connection
+    virtual size_t receiveAvailable() { return 0; }
+    // Like receive(), but returns 0 instead of waiting
+    virtual size_t receiveAvailable(void *target, size_t max) { return 0; }
+
+    // Sends all slices as if they were one buffer, without joining them first
+    virtual void send(const SendSlice *slices, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            send(slices[i].data, slices[i].size);
+    }
+
+    // Whether small writes should go out right away (TCP_NODELAY), no-op for non-TCP streams
+    virtual void setNoDelay(bool enabled) {}
+
+    // Used by the reactor to poll the connection, streams without a socket return -1
+    virtual int nativeHandle() const noexcept { return -1; }
+    // Bytes that were already read from the connection but not consumed yet
+    virtual size_t bufferedBytes() const noexcept { return 0; }
+    // Whether a whole request head was already read, so receiveHead() won't have to wait
+    virtual bool hasBufferedHead() const noexcept { return false; }
+
+    // Makes blocked and future reads and writes fail without giving up the handle,
+    // unlike close() this may be called from another thread
+    virtual void interrupt() noexcept {}
+
+    // Bytes that were sent but are still waiting for the client to take them
+    virtual size_t pendingOutput() const noexcept { return 0; }
+    // Sends as much of the pending output as the connection takes right now, returns true once all of it went out
+    virtual bool flushOutput() { return true; }
+    // Waits until no more than limit bytes are pending, throws if the client takes nothing for TINYHTTP_SEND_TIMEOUT
+    virtual void drainOutput(size_t limit = 0) {}
+
+    // Called when output starts waiting in the queue, returns true if it will be sent by someone
+    // waiting for the connection to become writable. Without one, send() waits until all of it went out
+    virtual void setOutputWatcher(std::function<bool()> watcher) {}
+
+    // Like send(), but what the connection doesn't take right away is left to the output watcher, or to the
+    // thread reading from the stream after flushOutputOnRead(). Without either it waits like send(). Sends
+    // nothing and returns false if more than limit bytes are waiting already
+    virtual bool queue(const SendSlice *slices, size_t count, size_t limit = SIZE_MAX) {
+        send(slices, count);
+        return true;
+    }
+
+    // For streams without an output watcher: output queue() left waiting is sent by the thread reading
+    // from the stream, which is woken for it. Called before other threads start queueing
+    virtual void flushOutputOnRead() {}
+
     // wrapper for send for any object having a data() -> uint8_t* and a size() -> integer function
     template<
             typename T,
@@ -119,28 +436,105 @@ struct IClientStream {
             typename Chk2 = typename std::enable_if<std::is_integral<decltype(T().size())>::value>::type>
     void send(const T &data) { send(data.data(), data.size()); }
 
-    bool mErrorFlag = false;
+    std::atomic<bool> mErrorFlag{false}; // set by publishers on other threads too
 };
 
 class TCPClientStream : public IClientStream {
     int mSocket;
 
+    // Everything read from the socket goes through this buffer, so lines and
+    // bodies are served from memory and whatever is left over after the headers
+    // stays available for the body reader or a protocol handover
+    std::unique_ptr<char[]> mReadBuffer;
+    size_t mReadPos = 0, mReadEnd = 0;
+
+    // Last TCP_NODELAY state set on the socket, -1 if it was never changed
+    int mNoDelay = -1;
+
+    // Output the socket didn't take yet, from mOutput[mOutputFirst] on, mOutputPos bytes of which went
+    // out already. Slices with an owner are referenced, the others are copied into the entry. Senders
+    // on other threads and the reactor flushing it share the lock
+    struct OutputEntry {
+        std::shared_ptr<const void> owner;
+        const void *data = nullptr; // into owner, or into copy if it has none
+        size_t size      = 0;
+        std::vector<uint8_t> copy;
+    };
+    std::vector<OutputEntry> mOutput;
+    size_t mOutputFirst = 0, mOutputPos = 0, mOutputSize = 0;
+    std::function<bool()> mOutputWatcher;
+#ifdef TINYHTTP_THREADING
+    mutable std::mutex mSendMutex;
+    int mWakeSocket = -1; // wakes the reader when output has to wait, see flushOutputOnRead()
+#endif
+
+    size_t fillReadBuffer();
+    void makeReadRoom();
+    void waitReadable();
+
+    // One recv() that doesn't wait, 0 if nothing arrived yet
+    size_t receiveNow(void *target, size_t max);
+
+    // Writes the slices without waiting and returns how much of them the socket took
+    size_t writeSome(const SendSlice *slices, size_t count);
+    bool flushLocked();
+    void appendLocked(const SendSlice *slices, size_t count, bool write);
+
 public:
-    ~TCPClientStream() { close(); }
-    TCPClientStream(short socket) : mSocket{socket} {}
+    ~TCPClientStream() {
+        close();
+#ifdef TINYHTTP_THREADING
+        if (mWakeSocket >= 0)
+            ::close(mWakeSocket);
+#endif
+    }
+    TCPClientStream(int socket) : mSocket{socket} {}
     TCPClientStream(const TCPClientStream &) = delete;
-    TCPClientStream(TCPClientStream &&other) : mSocket{other.mSocket} { other.mSocket = -1; }
+    TCPClientStream(TCPClientStream &&other)
+        : mSocket{other.mSocket}, mReadBuffer{std::move(other.mReadBuffer)}, mReadPos{other.mReadPos}, mReadEnd{other.mReadEnd}, mNoDelay{other.mNoDelay},
+          mOutput{std::move(other.mOutput)}, mOutputFirst{other.mOutputFirst}, mOutputPos{other.mOutputPos}, mOutputSize{other.mOutputSize},
+          mOutputWatcher{std::move(other.mOutputWatcher)} {
+        other.mSocket  = -1;
+        other.mReadPos = other.mReadEnd = other.mOutputFirst = other.mOutputPos = other.mOutputSize = 0;
+#ifdef TINYHTTP_THREADING
+        std::swap(mWakeSocket, other.mWakeSocket);
+#endif
+    }
 
-    static TCPClientStream acceptFrom(short listener);
+    // Returns a closed stream if accept() failed, errno tells why
+    static TCPClientStream acceptFrom(int listener);
 
     bool isOpen() noexcept override { return mSocket >= 0 && !mErrorFlag; }
     void send(const void *what, size_t size) override;
+    void send(const SendSlice *slices, size_t count) override;
+    void setNoDelay(bool enabled) override;
     size_t receive(void *target, size_t max) override;
     std::string receiveLine(bool asciiOnly = true, size_t max = -1) override;
+    std::string_view receiveHead(size_t max) override;
+    size_t receiveAvailable() override;
+    size_t receiveAvailable(void *target, size_t max) override;
     void close() override;
+
+    int nativeHandle() const noexcept override { return mSocket; }
+    size_t bufferedBytes() const noexcept override { return mReadEnd - mReadPos; }
+    bool hasBufferedHead() const noexcept override;
+
+    void interrupt() noexcept override {
+        if (mSocket >= 0)
+            ::shutdown(mSocket, SHUT_RDWR);
+    }
+
+    size_t pendingOutput() const noexcept override;
+    bool flushOutput() override;
+    void drainOutput(size_t limit = 0) override;
+    void setOutputWatcher(std::function<bool()> watcher) override { mOutputWatcher = std::move(watcher); }
+    bool queue(const SendSlice *slices, size_t count, size_t limit = SIZE_MAX) override;
+    void flushOutputOnRead() override;
 };
 
 struct StdinClientStream : IClientStream {
+    std::string mHead;
+
     bool isOpen() noexcept override { return true; }
     void send(const void *what, size_t size) override {
         fwrite(what, 1, size, stdout);
@@ -158,6 +552,18 @@ struct StdinClientStream : IClientStream {
 
         return res;
     }
+    std::string_view receiveHead(size_t max) override {
+        mHead.clear();
+
+        while (mHead.size() < max) {
+            std::string line = receiveLine();
+            mHead.append(line).append("\r\n");
+
+            if (line.empty()) break;
+        }
+
+        return mHead;
+    }
     void close() override {}
 };
 
@@ -178,258 +584,1175 @@ struct MessageBuilder : public std::vector<uint8_t> {
     void writeCRLF() { write("\r\n", 2); }
 
     void write(const void *data, const size_t len) {
-        size_t ogsize = size();
-        resize(ogsize + len);
-        memcpy(this->data() + ogsize, data, len);
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        insert(end(), bytes, bytes + len);
     }
 };
 
-class HttpMessageCommon {
-protected:
-    std::map<std::string, std::string> mHeaders;
-    std::string mContent;
+// Memory of a connection for everything that only lives until its responses were sent. Allocations
+// are taken from a fixed buffer one after another and all given back at once by release().
+// A message made while the arena is current keeps its headers in it, so anything that is kept
+// after the request was answered (a cache entry, a static response) must not be made there.
+// Copies of a message use the heap, and a message moved to where the arena isn't current has its
+// headers copied there. A static made inside a handler is neither and has to be avoided
+class HttpArena {
+    alignas(std::max_align_t) std::byte mBuffer[TINYHTTP_ARENA_SIZE];
+    std::pmr::monotonic_buffer_resource mResource{mBuffer, sizeof(mBuffer), std::pmr::new_delete_resource()};
 
-public:
-    std::string &operator[](std::string i) {
-        std::transform(i.begin(), i.end(), i.begin(), [](unsigned char c) { return std::tolower(c); });
+    static inline thread_local std::pmr::memory_resource *sCurrent = nullptr;
 
-        auto f = mHeaders.find(i);
-        if (f == mHeaders.end()) {
-            if (mHeaders.size() >= MAX_HTTP_HEADERS)
-                throw std::runtime_error("too many HTTP headers");
+public:
+    HttpArena() = default;
+    HttpArena(const HttpArena &) = delete;
+    HttpArena &operator=(const HttpArena &) = delete;
 
-            mHeaders.insert(std::pair<std::string, std::string>(i, ""));
-        }
+    // Everything allocated from it has to be gone by then
+    void release() noexcept { mResource.release(); }
 
-        return mHeaders.find(i)->second;
+    // Where responses and their headers are allocated on this thread: the arena of the connection
+    // whose request is being handled, the heap otherwise
+    static std::pmr::memory_resource *current() noexcept {
+        return sCurrent ? sCurrent : std::pmr::new_delete_resource();
     }
 
-    std::string operator[](std::string i) const {
-        std::transform(i.begin(), i.end(), i.begin(), [](unsigned char c) { return std::tolower(c); });
+    // Makes the arena current on this thread for as long as it exists
+    class Scope {
+        std::pmr::memory_resource *mPrevious;
 
-        auto f = mHeaders.find(i);
-        if (f == mHeaders.end())
-            return "";
+    public:
+        explicit Scope(HttpArena &arena) noexcept : mPrevious{sCurrent} { sCurrent = &arena.mResource; }
+        ~Scope() { sCurrent = mPrevious; }
 
-        return mHeaders.find(i)->second;
-    }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
 
-    void setContent(std::string content) {
-        mContent                  = std::move(content);
-        (*this)["Content-Length"] = std::to_string(mContent.size());
+    // The object and its reference count in a single allocation from current()
+    template<typename T, typename... Args>
+    static std::shared_ptr<T> makeShared(Args &&...args) {
+        return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>{current()}, std::forward<Args>(args)...);
     }
-
-    const auto &content() const noexcept { return mContent; }
 };
 
-class HttpRequest : public HttpMessageCommon {
-    HttpRequestMethod mMethod = HttpRequestMethod::UNKNOWN;
-    std::string path, query;
-
-#ifdef TINYHTTP_JSON
-    miniJson::Json mContentJson;
-#endif
+// Continues coroutine handlers after they waited for something. The reactor is one, it is current on
+// the threads it runs handlers on. Without one, handlers run from start to end on their connection's thread
+class HttpExecutor {
+    static inline thread_local HttpExecutor *sCurrent = nullptr;
 
 public:
-    bool parse(std::shared_ptr<IClientStream> stream);
+    virtual ~HttpExecutor() = default;
 
-    const HttpRequestMethod &getMethod() const noexcept { return mMethod; }
-    const std::string &getPath() const noexcept { return path; }
-    const std::string &getQuery() const noexcept { return query; }
+    // Resumes the coroutine on a worker, or right here if the workers are gone
+    virtual void resume(std::coroutine_handle<> handle) = 0;
 
-#ifdef TINYHTTP_JSON
-    const miniJson::Json &json() const noexcept { return mContentJson; }
-#endif
-};
+    // Runs the call on a thread that isn't a worker, returns false if there is none anymore
+    virtual bool runBlocking(std::function<void()> call) = 0;
 
-struct ICanRequestProtocolHandover {
-    virtual ~ICanRequestProtocolHandover()                                                                       = default;
-    virtual void acceptHandover(int &serverSock, IClientStream &client, std::unique_ptr<HttpRequest> srcRequest) = 0;
+    static HttpExecutor *current() noexcept { return sCurrent; }
+
+    class Scope {
+        HttpExecutor *mPrevious;
+
+    public:
+        explicit Scope(HttpExecutor &executor) noexcept : mPrevious{sCurrent} { sCurrent = &executor; }
+        ~Scope() { sCurrent = mPrevious; }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
 };
 
-#ifdef TINYHTTP_WS
-struct WebsockClientHandler {
-    virtual void onConnect() {}
-    virtual void onDisconnect() {}
-    virtual void onTextMessage(const std::string &message) {}
-    virtual void onBinaryMessage(const std::vector<uint8_t> &data) {}
+template<typename T>
+struct HttpTaskResult {
+    std::optional<T> value;
 
-    void sendRaw(uint8_t opcode, const void *data, size_t length, bool mask = false);
-    void sendDisconnect();
-    void sendText(const std::string &str);
-    void sendBinary(const void *data, size_t length);
+    template<typename U>
+    void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
 
-    template<size_t N>
-    inline void sendBinary(const uint8_t data[N]) {
-        sendBinary(data, N);
-    }
+    T take() { return std::move(*value); }
+};
 
-    // wrapper for send for any object having a data() -> uint8_t* and a size() -> integer function
-    template<
-            typename T,
-            typename Chk1 = typename std::enable_if<std::is_same<decltype(T().data()), uint8_t *>::value>::type,
-            typename Chk2 = typename std::enable_if<std::is_integral<decltype(T().size())>::value>::type>
-    void sendBinary(const T &data) { sendBinary(data.data(), data.size()); }
+template<>
+struct HttpTaskResult<void> {
+    void return_void() noexcept {}
+    void take() noexcept {}
+};
 
-#ifdef TINYHTTP_JSON
+// Result of a coroutine, handlers return HttpTask<HttpResponse>. A task starts once it is awaited,
+// or once the server runs it, and continues whoever awaited it when it is done
+template<typename T = void>
+class [[nodiscard]] HttpTask {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
 
-    inline void sendJson(const miniJson::Json &json) {
-        sendText(json.serialize());
-    }
+private:
+    Handle mHandle;
 
-#endif
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
 
-    void attachTcpStream(IClientStream *s) { mClient = s; }
-    void attachRequest(std::unique_ptr<HttpRequest> req) { mRequest.swap(req); }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+            promise_type &promise = handle.promise();
+            if (promise.continuation)
+                return promise.continuation;
 
-protected:
-    IClientStream *mClient;
-    std::unique_ptr<HttpRequest> mRequest;
-};
-#endif
+            // Started by start(), the one of the two that comes last tells the owner. The task may be
+            // gone as soon as it knows, so nothing of it is touched afterwards
+            if (promise.detached.exchange(true)) {
+                auto done = std::move(promise.done);
+                done();
+            }
 
-class HttpResponse : public HttpMessageCommon {
-    unsigned mStatusCode                   = 400;
-    ICanRequestProtocolHandover *mHandover = nullptr;
+            return std::noop_coroutine();
+        }
 
-public:
-    HttpResponse(const unsigned statusCode) : mStatusCode{statusCode} {
-        (*this)["Server"] = "tinyHTTP_1.1";
+        void await_resume() noexcept {}
+    };
 
-        if (statusCode >= 200)
-            (*this)["Content-Length"] = "0";
-    }
+    explicit HttpTask(Handle handle) noexcept : mHandle{handle} {}
 
-    HttpResponse(const unsigned statusCode, std::string contentType, std::string content)
-        : HttpResponse{statusCode} {
-        (*this)["Content-Type"] = contentType;
-        setContent(content);
-    }
+public:
+    struct promise_type : HttpTaskResult<T> {
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+        std::function<void()> done;
+        std::atomic<bool> detached{false};
+
+        HttpTask get_return_object() noexcept { return HttpTask{Handle::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+
+        // Frames are made where responses are, in the connection's arena while a request is handled
+        static constexpr size_t kFrameHeader = alignof(std::max_align_t);
+
+        static void *operator new(size_t size) {
+            std::pmr::memory_resource *resource = HttpArena::current();
+            void *frame                         = resource->allocate(size + kFrameHeader, alignof(std::max_align_t));
+
+            *static_cast<std::pmr::memory_resource **>(frame) = resource;
+            return static_cast<std::byte *>(frame) + kFrameHeader;
+        }
 
-    inline void requestProtocolHandover(ICanRequestProtocolHandover *newOwner) noexcept {
-        mHandover = newOwner;
-    }
+        static void operator delete(void *ptr, size_t size) {
+            void *frame = static_cast<std::byte *>(ptr) - kFrameHeader;
+            (*static_cast<std::pmr::memory_resource **>(frame))->deallocate(frame, size + kFrameHeader, alignof(std::max_align_t));
+        }
+    };
 
-    inline bool acceptProtocolHandover(ICanRequestProtocolHandover **outTarget) noexcept {
-        if (outTarget && mHandover) {
-            *outTarget = mHandover;
-            return true;
+    HttpTask(HttpTask &&other) noexcept : mHandle{std::exchange(other.mHandle, nullptr)} {}
+    HttpTask &operator=(HttpTask &&other) noexcept {
+        if (this != &other) {
+            if (mHandle)
+                mHandle.destroy();
+            mHandle = std::exchange(other.mHandle, nullptr);
         }
 
-        return false;
+        return *this;
     }
 
-#ifdef TINYHTTP_JSON
-    HttpResponse(const unsigned statusCode, const miniJson::Json &json)
-        : HttpResponse{statusCode, "application/json", json.serialize()} {}
-#endif
+    ~HttpTask() {
+        if (mHandle)
+            mHandle.destroy();
+    }
 
-#ifdef TINYHTTP_TEMPLATES
-    HttpResponse(const unsigned statusCode, HTMLTemplate &&_template)
-        : HttpResponse{statusCode, "text/html", _template.render()} {}
-#endif
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            Handle handle;
 
-    MessageBuilder buildMessage() {
-        MessageBuilder b;
+            bool await_ready() noexcept { return false; }
 
-        b.write("HTTP/1.1 " + std::to_string(mStatusCode));
-        b.writeCRLF();
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
 
-        for (auto &h : mHeaders)
-            if (!h.second.empty())
-                b.write(h.first + ": " + h.second + "\r\n");
+            T await_resume() { return HttpTask::resultOf(handle); }
+        };
 
-        b.writeCRLF();
-        b.write(mContent);
+        return Awaiter{mHandle};
+    }
 
-        return b;
+    // Runs the task until it is done or waits for something. Returns true if it is done,
+    // otherwise done() is called by the thread that finishes it
+    bool start(std::function<void()> done) {
+        mHandle.promise().done = std::move(done);
+        mHandle.resume();
+        return mHandle.promise().detached.exchange(true);
     }
-};
 
-struct HandlerBuilder {
-    virtual ~HandlerBuilder() = default;
+    // Rethrows what the coroutine threw, only once it is done
+    T result() { return resultOf(mHandle); }
 
-    virtual std::unique_ptr<HttpResponse> process(const HttpRequest &req) {
-        return nullptr;
+private:
+    static T resultOf(Handle handle) {
+        if (handle.promise().error)
+            std::rethrow_exception(handle.promise().error);
+
+        return handle.promise().take();
     }
 };
 
-#ifdef TINYHTTP_WS
-class WebsockHandlerBuilder : public HandlerBuilder, public ICanRequestProtocolHandover {
-    struct Factory {
-        virtual ~Factory()                           = default;
-        virtual WebsockClientHandler *makeInstance() = 0;
-    };
+// Awaited by coroutine handlers around blocking calls, like SDK functions that take a while. The call
+// runs on one of TINYHTTP_BLOCKING_THREADS threads while the workers serve other connections, then the
+// handler continues on a worker. Without an executor it is simply called
+template<typename F>
+class HttpBlockingCall {
+    typedef std::invoke_result_t<F &> Result;
 
-    template<typename T>
-    struct FactoryT : Factory {
-        virtual WebsockClientHandler *makeInstance() {
-            return new T();
+    F mCall;
+    std::conditional_t<std::is_void_v<Result>, bool, std::optional<Result>> mValue{};
+    std::exception_ptr mError;
+    bool mDone = false;
+
+    void run() noexcept {
+        try {
+            if constexpr (std::is_void_v<Result>)
+                mCall();
+            else
+                mValue.emplace(mCall());
+        } catch (...) {
+            mError = std::current_exception();
         }
-    };
 
-    std::unique_ptr<Factory> mFactory;
+        mDone = true;
+    }
 
 public:
-    WebsockHandlerBuilder()
-        : mFactory{new FactoryT<WebsockClientHandler>} {}
+    explicit HttpBlockingCall(F call) : mCall{std::move(call)} {}
 
-    template<typename T>
-    void handleWith() {
-        mFactory = std::unique_ptr<Factory>(new FactoryT<T>);
+    bool await_ready() const noexcept {
+        return HttpExecutor::current() == nullptr;
     }
 
-    virtual std::unique_ptr<HttpResponse> process(const HttpRequest &req) override;
+    // The handler may continue before runBlocking() returned, nothing of this is touched after run()
+    bool await_suspend(std::coroutine_handle<> handle) {
+        HttpExecutor *executor = HttpExecutor::current();
 
-    void acceptHandover(int &serverSock, IClientStream &client, std::unique_ptr<HttpRequest> srcRequest) override;
-};
-#endif
+        return executor->runBlocking([this, executor, handle]() {
+            run();
+            executor->resume(handle);
+        });
+    }
 
-class HttpHandlerBuilder : public HandlerBuilder {
-    typedef std::function<HttpResponse(const HttpRequest &)> HandlerFunc;
+    Result await_resume() {
+        if (!mDone)
+            run();
 
-    std::map<HttpRequestMethod, HandlerFunc> mHandlers;
+        if (mError)
+            std::rethrow_exception(mError);
 
-    static bool isSafeFilename(const std::string &name, bool allowSlash);
-    static std::string getMimeType(std::string name);
+        if constexpr (!std::is_void_v<Result>)
+            return std::move(*mValue);
+    }
+};
 
-public:
-    HttpHandlerBuilder *posted(HandlerFunc h) {
-        mHandlers.insert(std::pair<HttpRequestMethod, HandlerFunc>(HttpRequestMethod::POST, std::move(h)));
+template<typename F>
+HttpBlockingCall<std::decay_t<F>> offloadBlocking(F &&call) {
+    return HttpBlockingCall<std::decay_t<F>>{std::forward<F>(call)};
+}
+
+class HttpMessageCommon {
+protected:
+    struct HeaderEntry {
+        uint32_t hash;
+        HttpHeader id;
+        std::pmr::string name, value;
+    };
+
+    // There are only a handful of headers per message, a linear scan over
+    // the pre-hashed names is cheaper than walking a tree of strings.
+    // Made in the current arena, copies of a message use the heap
+    std::pmr::vector<HeaderEntry> mHeaders{HttpArena::current()};
+    std::string mContent;
+
+    const HeaderEntry *findHeader(std::string_view name, uint32_t hash) const noexcept {
+        for (auto &h : mHeaders)
+            if (h.hash == hash && equalsHttpHeaderName(h.name, name))
+                return &h;
+
+        return nullptr;
+    }
+
+    const HeaderEntry *findHeader(HttpHeader id) const noexcept {
+        for (auto &h : mHeaders)
+            if (h.id == id)
+                return &h;
+
+        return nullptr;
+    }
+
+    // Takes the headers of another message as they are if both use the same memory, otherwise they
+    // are copied into this one's. Strings moved on their own would keep pointing into the other
+    void moveHeaders(std::pmr::vector<HeaderEntry> &&headers) {
+        if (headers.get_allocator() == mHeaders.get_allocator()) {
+            mHeaders = std::move(headers);
+            return;
+        }
+
+        auto alloc = mHeaders.get_allocator();
+        mHeaders.clear();
+        mHeaders.reserve(headers.size());
+
+        for (auto &h : headers)
+            mHeaders.push_back(HeaderEntry{h.hash, h.id, std::pmr::string{h.name, alloc}, std::pmr::string{h.value, alloc}});
+    }
+
+    std::pmr::string &insertHeader(std::string_view name, uint32_t hash, HttpHeader id) {
+        if (mHeaders.size() >= MAX_HTTP_HEADERS)
+            throw std::runtime_error("too many HTTP headers");
+
+        auto alloc = mHeaders.get_allocator();
+        return mHeaders.emplace_back(HeaderEntry{hash, id, std::pmr::string{name, alloc}, std::pmr::string{alloc}}).value;
+    }
+
+public:
+    HttpMessageCommon() = default;
+    HttpMessageCommon(const HttpMessageCommon &)            = default;
+    HttpMessageCommon &operator=(const HttpMessageCommon &) = default;
+
+    // Moved into the arena that is current here, or onto the heap outside of a request
+    HttpMessageCommon(HttpMessageCommon &&other) : mContent{std::move(other.mContent)} {
+        moveHeaders(std::move(other.mHeaders));
+    }
+
+    HttpMessageCommon &operator=(HttpMessageCommon &&other) {
+        mContent = std::move(other.mContent);
+        moveHeaders(std::move(other.mHeaders));
+        return *this;
+    }
+
+    std::pmr::string &operator[](std::string_view name) {
+        uint32_t hash = hashHttpHeaderName(name);
+
+        if (auto f = findHeader(name, hash))
+            return const_cast<std::pmr::string &>(f->value);
+
+        return insertHeader(name, hash, identifyHttpHeader(name, hash));
+    }
+
+    std::pmr::string &operator[](HttpHeader id) {
+        if (auto f = findHeader(id))
+            return const_cast<std::pmr::string &>(f->value);
+
+        std::string_view name = httpHeaderName(id);
+        return insertHeader(name, hashHttpHeaderName(name), id);
+    }
+
+    std::string operator[](std::string_view name) const {
+        return std::string{header(name)};
+    }
+
+    // Doesn't allocate, returns an empty view if the header is missing
+    std::string_view header(std::string_view name) const noexcept {
+        auto f = findHeader(name, hashHttpHeaderName(name));
+        return f ? std::string_view{f->value} : std::string_view{};
+    }
+
+    std::string_view header(HttpHeader id) const noexcept {
+        auto f = findHeader(id);
+        return f ? std::string_view{f->value} : std::string_view{};
+    }
+
+    void setContent(std::string content) {
+        mContent                            = std::move(content);
+        (*this)[HttpHeader::CONTENT_LENGTH] = std::to_string(mContent.size());
+    }
+
+    const auto &content() const noexcept { return mContent; }
+};
+
+// Kinds of route parameters, in the order they are tried when more than one could match
+enum class PathParamType : uint8_t {
+    INT,    // {name:int}, decimal digits
+    HEX,    // {name:hex}, hexadecimal digits
+    STRING, // {name}, any non-empty segment
+    REST,   // {name*} or *, the rest of the path, has to be the last segment
+};
+
+struct PathParam {
+    std::string_view name; // owned by the router
+    PathParamType type;
+    uint32_t offset, length; // inside the request path
+};
+
+// How the body of a request is read before its handler runs, set per route
+struct HttpContentPolicy {
+    size_t maxSize = MAX_HTTP_CONTENT_SIZE;
+    bool streamed  = false; // the handler reads it with HttpRequest::readContent(), content() stays empty
+};
+
+#ifdef TINYHTTP_TRACING
+// Where the time of a request went. It starts once the head arrived, waiting for it isn't counted
+struct HttpTrace {
+    enum Phase : uint8_t {
+        HEAD,      // parsing the head
+        BODY,      // reading a buffered body
+        JSON,      // parsing it as JSON
+        ROUTING,   // finding the route
+        HANDLER,   // running the handler, a coroutine handler until it is done
+        SERIALIZE, // writing the response head
+        SEND,      // writing the output to the socket
+        PHASE_COUNT
+    };
+
+    static constexpr const char *kPhaseNames[PHASE_COUNT] = {"head", "body", "json", "routing", "handler", "serialize", "send"};
+
+    std::chrono::steady_clock::time_point start;
+    uint64_t nanos[PHASE_COUNT] = {};
+    uint64_t totalNanos         = 0; // until the response was written to the socket
+    unsigned statusCode         = 0;
+    HttpRequestMethod method    = HttpRequestMethod::UNKNOWN;
+    uint8_t pathLength          = 0;
+    char path[TINYHTTP_TRACE_PATH_SIZE];
+
+    // Adds the time from since until now to phase, returns now so the next phase can start there
+    std::chrono::steady_clock::time_point add(Phase phase, std::chrono::steady_clock::time_point since) noexcept {
+        auto now = std::chrono::steady_clock::now();
+        nanos[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+        return now;
+    }
+};
+#endif
+
+// A request that can't be served as it was sent, answered with statusCode (400 or 413)
+struct HttpRequestError : std::runtime_error {
+    unsigned statusCode;
+
+    HttpRequestError(unsigned statusCode, const char *what)
+        : std::runtime_error{what}, statusCode{statusCode} {}
+};
+
+class HttpRequest : public HttpMessageCommon {
+    // Position of a field inside mHead, copies of the request stay valid this way
+    struct HeadSlice {
+        uint32_t offset = 0, length = 0;
+    };
+
+    HttpRequestMethod mMethod = HttpRequestMethod::UNKNOWN;
+
+    // The request line and headers exactly as received, every field below points into it.
+    // Reusing a request object for the next request on a connection reuses this buffer as well
+    std::string mHead;
+    HeadSlice mPath, mQuery;
+    struct {
+        uint32_t hash;
+        HttpHeader id;
+        HeadSlice name, value;
+    } mHeaderFields[MAX_HTTP_HEADERS];
+    size_t mHeaderCount = 0;
+
+    // Filled in by the router for the route that matched the path
+    std::vector<PathParam> mParams;
+
+    // Body framing is known with the head, the body itself may be read by the handler.
+    // That doesn't change the request, so the reading state is mutable
+    bool mChunked                         = false;
+    bool mContentReceived                 = false;
+    mutable IClientStream *mContentStream = nullptr;
+    mutable uint64_t mContentLeft         = 0; // of the current chunk for chunked bodies
+    mutable uint64_t mContentRead         = 0;
+    mutable size_t mMaxContentSize        = MAX_HTTP_CONTENT_SIZE;
+    mutable bool mChunkStarted            = false;
+    mutable bool mContentDone             = true;
+    mutable bool mContentFailed           = false;
+    mutable std::vector<char> mContentBuffer; // for readContent(consume), kept for the connection
+
+#ifdef TINYHTTP_JSON
+    miniJson::Json mContentJson;
+#endif
+
+#ifdef TINYHTTP_TRACING
+    HttpTrace mTrace;
+#endif
+
+    inline std::string_view slice(HeadSlice s) const noexcept {
+        return {mHead.data() + s.offset, s.length};
+    }
+
+    bool parseHead();
+    bool parseContentFraming();
+    size_t nextContentRun() const;
+
+    // Reads what arrived of a body with a Content-Length up to maxSize without waiting, receiveContent()
+    // continues from there. Returns true once nothing is left to wait for, other bodies are left to it
+    bool bufferContent(size_t maxSize);
+
+    friend class HttpServer;
+
+public:
+    bool parse(std::shared_ptr<IClientStream> stream);
+
+    // The two halves of parse(), for callers that treat reading the head and the body differently.
+    // A buffered body is read into content() right away, a streamed one is left to readContent()
+    bool receiveHead(IClientStream &stream);
+    void receiveContent(HttpContentPolicy policy = {});
+
+    // Whether part of the body wasn't read yet
+    bool hasContent() const noexcept { return !mContentDone; }
+
+    // Size of the head and of the part of the body that was read so far
+    uint64_t receivedBytes() const noexcept { return mHead.size() + mContentRead; }
+
+    // Reads the next part of a streamed body, chunked transfer encoding is decoded. Returns 0
+    // at the end, throws HttpRequestError if the body is malformed or over the route's limit
+    size_t readContent(void *target, size_t max) const;
+
+    // Hands the rest of the body to consume(std::string_view) piece by piece, all through one
+    // buffer that is reused for the whole connection. Returns the number of bytes read
+    template<typename F>
+    size_t readContent(F &&consume) const {
+        if (mContentBuffer.empty())
+            mContentBuffer.resize(TINYHTTP_READ_BUFFER_SIZE);
+
+        size_t total = 0;
+        while (size_t len = readContent(mContentBuffer.data(), mContentBuffer.size())) {
+            consume(std::string_view{mContentBuffer.data(), len});
+            total += len;
+        }
+
+        return total;
+    }
+
+    // Skips what the handler left unread so the next request on the connection can follow,
+    // false if the connection can't be reused
+    bool discardContent() noexcept;
+
+    const HttpRequestMethod &getMethod() const noexcept { return mMethod; }
+    std::string_view getPath() const noexcept { return slice(mPath); }
+    std::string_view getQuery() const noexcept { return slice(mQuery); }
+
+    // Path and query together as the request line had them, the query follows the path in mHead
+    std::string_view getTarget() const noexcept { return {mHead.data() + mPath.offset, mPath.length + mQuery.length}; }
+
+    // Case-insensitive, returns an empty view if the header is missing
+    std::string_view header(std::string_view name) const noexcept;
+    std::string_view header(HttpHeader id) const noexcept;
+
+    std::string operator[](std::string_view name) const {
+        return std::string{header(name)};
+    }
+
+    std::string operator[](HttpHeader id) const {
+        return std::string{header(id)};
+    }
+
+    // Value of a parameter of the matched route, empty if the route has no such parameter
+    std::string_view param(std::string_view name) const noexcept;
+
+    // Parses an integer parameter ({id:hex} in base 16, everything else in base 10),
+    // throws if it is missing or doesn't fit into T
+    template<typename T>
+    T param(std::string_view name) const {
+        for (auto &p : mParams) {
+            if (p.name != name) continue;
+
+            std::string_view value = getPath().substr(p.offset, p.length);
+            T result{};
+
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result, p.type == PathParamType::HEX ? 16 : 10);
+            if (ec != std::errc{} || end != value.data() + value.size())
+                throw std::runtime_error("invalid path parameter");
+
+            return result;
+        }
+
+        throw std::runtime_error("missing path parameter");
+    }
+
+#ifdef TINYHTTP_JSON
+    const miniJson::Json &json() const noexcept { return mContentJson; }
+#endif
+
+#ifdef TINYHTTP_TRACING
+    HttpTrace &trace() noexcept { return mTrace; }
+    const HttpTrace &trace() const noexcept { return mTrace; }
+#endif
+};
+
+struct ICanRequestProtocolHandover {
+    virtual ~ICanRequestProtocolHandover()                                                                       = default;
+    virtual void acceptHandover(int &serverSock, IClientStream &client, std::unique_ptr<HttpRequest> srcRequest) = 0;
+};
+
+#ifdef TINYHTTP_WS
+// Splits the input of a websocket connection into frames. Input is read in pieces as large as the
+// buffer, and every frame a piece holds is decoded without reading again. A frame cut off at the
+// end of a read, header or payload, is completed by the next ones
+class WebsockFrameDecoder {
+    std::vector<uint8_t> mBuffer;
+    size_t mStart = 0, mEnd = 0;
+    size_t mWanted = 0; // size of the frame that was cut off, once its header is complete
+
+public:
+    struct Frame {
+        bool fin;
+        bool masked;      // clients have to mask every frame
+        uint8_t reserved; // RSV1-3, as in the first byte
+        uint8_t opcode;
+        std::span<uint8_t> payload; // unmasked, valid until the next fill()
+    };
+
+    WebsockFrameDecoder()
+        : mBuffer(TINYHTTP_READ_BUFFER_SIZE) {}
+
+    // Takes the next complete frame from what was read so far, false if more input is needed.
+    // Throws for frames larger than MAX_ALLOWED_WS_FRAME_LENGTH
+    bool next(Frame &frame);
+
+    // Reads more input, false once the client closed the connection
+    bool fill(IClientStream &client);
+
+    size_t buffered() const noexcept { return mEnd - mStart; }
+};
+
+class WebsockTopic;
+struct WebsockClientHandler;
+#ifdef TINYHTTP_COMPRESSION
+struct WebsockDeflate;
+#endif
+
+// A handler as the topics it joined see it. Publishers keep it alive while they send,
+// handler is cleared once the handler left, so none of them reaches it afterwards
+struct WebsockSubscriber {
+#ifdef TINYHTTP_THREADING
+    std::mutex mutex; // held while sending to the handler, and while it joins or leaves topics
+#endif
+    WebsockClientHandler *handler;
+    std::vector<WebsockTopic *> topics;
+
+    explicit WebsockSubscriber(WebsockClientHandler *h)
+        : handler{h} {}
+};
+
+struct WebsockClientHandler {
+    virtual ~WebsockClientHandler() { leaveTopics(); }
+
+    virtual void onConnect() {}
+    virtual void onDisconnect() {}
+    virtual void onTextMessage(const std::string &message) {}
+    virtual void onBinaryMessage(const std::vector<uint8_t> &data) {}
+
+    void sendRaw(uint8_t opcode, const void *data, size_t length, bool mask = false);
+    // Sends a close frame, with the status code unless it is 0
+    void sendDisconnect(uint16_t code = 0);
+
+    // Splits messages sent from now on into frames of at most size bytes, 0 doesn't split them
+    void setFragmentSize(size_t size) noexcept { mFragmentSize = size; }
+    void sendText(const std::string &str);
+    void sendBinary(const void *data, size_t length);
+
+    template<size_t N>
+    inline void sendBinary(const uint8_t data[N]) {
+        sendBinary(data, N);
+    }
+
+    // wrapper for send for any object having a data() -> uint8_t* and a size() -> integer function
+    template<
+            typename T,
+            typename Chk1 = typename std::enable_if<std::is_same<decltype(T().data()), uint8_t *>::value>::type,
+            typename Chk2 = typename std::enable_if<std::is_integral<decltype(T().size())>::value>::type>
+    void sendBinary(const T &data) { sendBinary(data.data(), data.size()); }
+
+#ifdef TINYHTTP_JSON
+
+    inline void sendJson(const miniJson::Json &json) {
+        sendText(json.serialize());
+    }
+
+#endif
+
+    void attachTcpStream(IClientStream *s) { mClient = s; }
+    void attachRequest(std::unique_ptr<HttpRequest> req) { mRequest.swap(req); }
+
+    // Leaves every topic it joined, done when the connection ends
+    void leaveTopics();
+
+protected:
+    IClientStream *mClient;
+    std::unique_ptr<HttpRequest> mRequest;
+    size_t mFragmentSize = WS_FRAGMENT_THRESHOLD;
+
+private:
+    friend class WebsockTopic;
+    friend class WebsockHandlerBuilder;
+
+    std::shared_ptr<WebsockSubscriber> mSubscriber = std::make_shared<WebsockSubscriber>(this);
+#ifdef TINYHTTP_COMPRESSION
+    std::shared_ptr<WebsockDeflate> mDeflate; // set if permessage-deflate was negotiated
+#endif
+#ifdef TINYHTTP_THREADING
+    std::mutex mSendMutex; // held for all frames of a message, nothing may get between its fragments
+#endif
+
+    // Compresses the message if it should be, then queues its frames without waiting for the client. These
+    // return false if the connection failed, or if more than limit bytes were waiting, which closes it
+    bool sendMessage(uint8_t opcode, const void *data, size_t length, bool mask, size_t limit);
+    bool sendFrames(uint8_t opcode, uint8_t reserved, const uint8_t *payload, size_t length, bool mask, size_t limit);
+    bool queueFrame(const SendSlice *slices, size_t count, size_t limit);
+    bool waitForOutput();
+};
+
+// Handlers that messages are published to. A message is framed once into a shared buffer, and the queue
+// of a subscriber that can't take it yet keeps a reference to it, not a copy. Publishing only copies the
+// current list of subscribers, so joining and leaving don't wait for publishers to finish sending. Must
+// outlive the handlers that joined it
+class WebsockTopic {
+    using SubscriberList = std::vector<std::shared_ptr<WebsockSubscriber>>;
+
+    std::shared_ptr<const SubscriberList> mSubscribers = std::make_shared<const SubscriberList>();
+#ifdef TINYHTTP_THREADING
+    mutable std::mutex mMutex; // held to copy or replace the list, never while sending
+#endif
+
+    std::shared_ptr<const SubscriberList> subscribers() const;
+    void remove(const std::shared_ptr<WebsockSubscriber> &subscriber);
+
+    friend struct WebsockClientHandler;
+
+public:
+    void subscribe(WebsockClientHandler &client);
+    void unsubscribe(WebsockClientHandler &client);
+
+    // Queues a message for every subscriber but except and returns how many got it. It never waits for
+    // a subscriber, one with more than TINYHTTP_OUTPUT_HIGH_WATERMARK waiting is closed instead
+    size_t publish(uint8_t opcode, const void *data, size_t length, const WebsockClientHandler *except = nullptr);
+
+    size_t publishText(std::string_view text, const WebsockClientHandler *except = nullptr) {
+        return publish(WSOPC_TEXT, text.data(), text.size(), except);
+    }
+
+    size_t publishBinary(const void *data, size_t length, const WebsockClientHandler *except = nullptr) {
+        return publish(WSOPC_BINARY, data, length, except);
+    }
+
+    size_t subscriberCount() const { return subscribers()->size(); }
+};
+
+// Topics by name. They are never removed, so a topic can be looked up once and
+// kept, then publishing to it doesn't touch the hub at all
+class WebsockHub {
+    std::map<std::string, WebsockTopic, std::less<>> mTopics;
+#ifdef TINYHTTP_THREADING
+    std::mutex mMutex;
+#endif
+
+public:
+    WebsockTopic &topic(std::string_view name);
+
+    void subscribe(WebsockClientHandler &client, std::string_view name) { topic(name).subscribe(client); }
+    void unsubscribe(WebsockClientHandler &client, std::string_view name) { topic(name).unsubscribe(client); }
+
+    size_t publishText(std::string_view name, std::string_view text, const WebsockClientHandler *except = nullptr) {
+        return topic(name).publishText(text, except);
+    }
+
+    size_t publishBinary(std::string_view name, const void *data, size_t length, const WebsockClientHandler *except = nullptr) {
+        return topic(name).publishBinary(data, length, except);
+    }
+};
+#endif
+
+#ifdef TINYHTTP_COMPRESSION
+class HttpDeflater;
+#endif
+
+class HttpResponse : public HttpMessageCommon {
+public:
+    // Appends the next part of a streamed body to out, returns false once nothing follows
+    typedef std::function<bool(MessageBuilder &out)> ContentProducer;
+
+private:
+    unsigned mStatusCode                   = 400;
+    ICanRequestProtocolHandover *mHandover = nullptr;
+    bool mNoDelay                          = true;
+
+    // Already serialized status line, headers and content, sent as they are
+    SendSlice mPrebuiltMessage{};
+
+    ContentProducer mProducer;
+    ContentCoding mProducerCoding = ContentCoding::IDENTITY; // streamed bodies are compressed while they are sent
+    uint64_t mStreamedBytes       = 0;
+#ifdef TINYHTTP_COMPRESSION
+    std::shared_ptr<HttpDeflater> mDeflater; // kept while a compressed body is being streamed
+#endif
+
+    // Part of a body owned by someone else, like the file cache, sent from where it is
+    std::shared_ptr<const std::string> mSharedContent;
+    std::string_view mSharedSlice;
+
+    // A coroutine handler that isn't done yet, the response it returns replaces this one
+    std::shared_ptr<HttpTask<HttpResponse>> mTask;
+
+    HttpResponse() = default;
+
+public:
+    HttpResponse(const unsigned statusCode) : mStatusCode{statusCode} {
+        mHeaders.reserve(4);
+        (*this)[HttpHeader::SERVER] = "tinyHTTP_1.1";
+
+        if (statusCode >= 200)
+            (*this)[HttpHeader::CONTENT_LENGTH] = "0";
+    }
+
+    HttpResponse(const unsigned statusCode, std::string_view contentType, std::string content)
+        : HttpResponse{statusCode} {
+        (*this)[HttpHeader::CONTENT_TYPE] = contentType;
+        setContent(std::move(content));
+    }
+
+    // The body is made by producer while it is sent with chunked transfer encoding,
+    // so it never has to be in memory as a whole
+    HttpResponse(const unsigned statusCode, std::string_view contentType, ContentProducer producer)
+        : HttpResponse{statusCode} {
+        (*this)[HttpHeader::CONTENT_TYPE]      = contentType;
+        (*this)[HttpHeader::CONTENT_LENGTH]    = "";
+        (*this)[HttpHeader::TRANSFER_ENCODING] = "chunked";
+        mProducer                              = std::move(producer);
+    }
+
+    // Wraps a message made by buildMessage(), the headers and content of the
+    // returned response are ignored when it is sent
+    static HttpResponse prebuilt(unsigned statusCode, std::shared_ptr<const MessageBuilder> message) {
+        HttpResponse res;
+        res.mStatusCode      = statusCode;
+        res.mPrebuiltMessage = {message->data(), message->size(), std::move(message)};
+
+        return res;
+    }
+
+    // Same for a message that outlives every response, like the ones generated by htpack
+    static HttpResponse prebuilt(unsigned statusCode, SendSlice message) noexcept {
+        HttpResponse res;
+        res.mStatusCode      = statusCode;
+        res.mPrebuiltMessage = {message.data, message.size, SendSlice::staticOwner(message.data)};
+
+        return res;
+    }
+
+    inline bool isPrebuilt() const noexcept {
+        return mPrebuiltMessage.data != nullptr;
+    }
+
+    // Stands in for the response of a coroutine handler until the server ran it
+    static HttpResponse deferred(HttpTask<HttpResponse> task) {
+        HttpResponse res;
+        res.mTask = HttpArena::makeShared<HttpTask<HttpResponse>>(std::move(task));
+
+        return res;
+    }
+
+    inline bool isDeferred() const noexcept {
+        return mTask != nullptr;
+    }
+
+    inline HttpTask<HttpResponse> &task() noexcept {
+        return *mTask;
+    }
+
+    // Sends length bytes of content starting at offset without copying them, the response
+    // keeps the string alive until it was sent
+    void setSharedContent(std::shared_ptr<const std::string> content, size_t offset, size_t length) {
+        mSharedSlice                        = std::string_view{*content}.substr(offset, length);
+        mSharedContent                      = std::move(content);
+        (*this)[HttpHeader::CONTENT_LENGTH] = std::to_string(mSharedSlice.size());
+    }
+
+    // Moves a buffered body of more than minSize bytes into shared content, so it can still be sent
+    // once the response is gone. The body isn't copied
+    void shareContent(size_t minSize) {
+        if (isPrebuilt() || mSharedContent || mContent.size() <= minSize)
+            return;
+
+        auto content   = std::make_shared<const std::string>(std::move(mContent));
+        mSharedSlice   = *content;
+        mSharedContent = std::move(content);
+    }
+
+    inline bool isStreamed() const noexcept {
+        return static_cast<bool>(mProducer);
+    }
+
+    inline unsigned getStatusCode() const noexcept {
+        return mStatusCode;
+    }
+
+    inline void requestProtocolHandover(ICanRequestProtocolHandover *newOwner) noexcept {
+        mHandover = newOwner;
+    }
+
+    inline bool acceptProtocolHandover(ICanRequestProtocolHandover **outTarget) noexcept {
+        if (outTarget && mHandover) {
+            *outTarget = mHandover;
+            return true;
+        }
+
+        return false;
+    }
+
+#ifdef TINYHTTP_JSON
+    HttpResponse(const unsigned statusCode, const miniJson::Json &json)
+        : HttpResponse{statusCode, "application/json", json.serialize()} {}
+#endif
+
+#ifdef TINYHTTP_TEMPLATES
+    HttpResponse(const unsigned statusCode, HTMLTemplate &&_template)
+        : HttpResponse{statusCode, "text/html", _template.render()} {}
+#endif
+
+    // Small responses are pushed out right away by default, turn this off for
+    // responses that are followed by many small writes (e.g. a protocol handover)
+    inline void setNoDelay(bool enabled) noexcept {
+        mNoDelay = enabled;
+    }
+
+    // Appends the status line and headers, the buffer is grown once to fit them
+    void writeHead(MessageBuilder &out) const;
+
+    inline bool noDelay() const noexcept {
+        return mNoDelay;
+    }
+
+    // Appends the head to headBuffer and returns the content that has to follow it (the whole
+    // message for prebuilt responses), the returned slice is valid as long as the response or
+    // its owner, prebuilt and shared content has one
+    SendSlice serialize(MessageBuilder &headBuffer) const;
+
+    // Sends the head from the given scratch buffer and the body by reference in a single gathered write
+    void send(IClientStream &stream, MessageBuilder &headBuffer) const;
+
+    // Runs the producer of a streamed response and sends its body after the head went out,
+    // every chunk is collected in buffer. Returns false if it stopped early because more than
+    // TINYHTTP_OUTPUT_HIGH_WATERMARK is waiting for the client, the next call continues there
+    bool sendChunks(IClientStream &stream, MessageBuilder &buffer);
+
+    // What sendChunks() sent so far, chunk framing included
+    inline uint64_t streamedBytes() const noexcept {
+        return mStreamedBytes;
+    }
+
+#ifdef TINYHTTP_COMPRESSION
+    // Compresses a buffered body of at least minSize bytes if that makes it smaller, a streamed
+    // one is compressed chunk by chunk while it is sent. Prebuilt, shared and already encoded
+    // bodies are left alone
+    void compress(ContentCoding coding, size_t minSize = TINYHTTP_COMPRESS_MIN_SIZE);
+#endif
+
+    MessageBuilder buildMessage() const {
+        if (isPrebuilt()) {
+            MessageBuilder b;
+            b.write(mPrebuiltMessage.data, mPrebuiltMessage.size);
+            return b;
+        }
+
+        if (mProducer)
+            throw std::runtime_error("streamed responses can't be built in advance");
+
+        MessageBuilder b;
+
+        writeHead(b);
+        if (mSharedContent)
+            b.write(mSharedSlice.data(), mSharedSlice.size());
+        else
+            b.write(mContent);
+
+        return b;
+    }
+};
+
+// Request statistics of a route, see HttpServer::enableMetrics(). Every thread counts into one of
+// TINYHTTP_METRICS_SHARDS copies of the counters, so recording a request takes no lock and
+// threads rarely share a cache line. The copies are only added up when the metrics are scraped
+class HttpRouteMetrics {
+public:
+    // 64 bit counters where they are lock-free, others wrap around at 32 bits
+    typedef std::conditional_t<std::atomic<uint64_t>::is_always_lock_free, uint64_t, uint32_t> Counter;
+
+    // The latency buckets end at 100us, 200us, 400us and so on up to 3.3s, one more takes everything above
+    static constexpr unsigned kLatencyBuckets    = 16;
+    static constexpr unsigned kFirstBucketMicros = 100;
+
+    struct Totals {
+        uint64_t statusClasses[5] = {}; // 1xx to 5xx
+        uint64_t bytesIn = 0, bytesOut = 0;
+        uint64_t latencyMicros                = 0;
+        uint64_t latency[kLatencyBuckets + 1] = {}; // not cumulative
+    };
+
+    explicit HttpRouteMetrics(std::string route) : mRoute{std::move(route)} {}
+    HttpRouteMetrics(const HttpRouteMetrics &) = delete;
+
+    inline const std::string &route() const noexcept {
+        return mRoute;
+    }
+
+    // latency is the time from the parsed head until the response was queued
+    void record(unsigned statusCode, uint64_t bytesIn, uint64_t bytesOut, std::chrono::steady_clock::duration latency) noexcept;
+
+    // The body of a streamed response is counted while it is sent
+    void addBytesOut(uint64_t bytes) noexcept;
+
+    Totals collect() const noexcept;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<Counter> statusClasses[5], bytesIn, bytesOut, latencyMicros, latency[kLatencyBuckets + 1];
+    };
+
+    std::string mRoute;
+    Shard mShards[TINYHTTP_METRICS_SHARDS];
+
+    Shard &threadShard() noexcept;
+};
+
+struct HandlerBuilder {
+    virtual ~HandlerBuilder() = default;
+
+    // Where the requests this handler answers are counted, set while metrics are enabled
+    HttpRouteMetrics *metrics = nullptr;
+
+    virtual std::shared_ptr<HttpResponse> process(const HttpRequest &req) {
+        return nullptr;
+    }
+
+    // How the body is read before process() is called
+    virtual HttpContentPolicy contentPolicy() const noexcept {
+        return {};
+    }
+};
+
+#ifdef TINYHTTP_WS
+class WebsockHandlerBuilder : public HandlerBuilder, public ICanRequestProtocolHandover {
+    struct Factory {
+        virtual ~Factory()                           = default;
+        virtual WebsockClientHandler *makeInstance() = 0;
+    };
+
+    template<typename T>
+    struct FactoryT : Factory {
+        virtual WebsockClientHandler *makeInstance() {
+            return new T();
+        }
+    };
+
+    std::unique_ptr<Factory> mFactory;
+#ifdef TINYHTTP_COMPRESSION
+    bool mCompress = false, mContextTakeover = true;
+    size_t mCompressMinSize = TINYHTTP_COMPRESS_MIN_SIZE;
+#endif
+
+public:
+    WebsockHandlerBuilder()
+        : mFactory{new FactoryT<WebsockClientHandler>} {}
+
+    template<typename T>
+    void handleWith() {
+        mFactory = std::unique_ptr<Factory>(new FactoryT<T>);
+    }
+
+#ifdef TINYHTTP_COMPRESSION
+    // Negotiates permessage-deflate with clients that offer it, messages of at least minSize bytes are
+    // compressed. With context takeover each connection keeps its deflate and inflate state between
+    // messages, so repetitive ones shrink a lot more. Without it nothing is kept per connection, and
+    // a topic compresses a message once for all such subscribers
+    WebsockHandlerBuilder *compress(size_t minSize = TINYHTTP_COMPRESS_MIN_SIZE, bool contextTakeover = true) {
+        mCompress        = true;
+        mCompressMinSize = minSize;
+        mContextTakeover = contextTakeover;
         return this;
     }
+#endif
 
-    HttpHandlerBuilder *requested(HandlerFunc h) {
-        mHandlers.insert(std::pair<HttpRequestMethod, HandlerFunc>(HttpRequestMethod::GET, std::move(h)));
+    virtual std::shared_ptr<HttpResponse> process(const HttpRequest &req) override;
+
+    void acceptHandover(int &serverSock, IClientStream &client, std::unique_ptr<HttpRequest> srcRequest) override;
+};
+#endif
+
+class HttpHandlerBuilder : public HandlerBuilder {
+    typedef std::function<HttpResponse(const HttpRequest &)> HandlerFunc;
+    typedef std::function<HttpTask<HttpResponse>(const HttpRequest &)> AsyncHandlerFunc;
+
+    // One of the two is set
+    struct Handler {
+        HandlerFunc func;
+        AsyncHandlerFunc asyncFunc;
+    };
+
+    struct CachedResponse {
+        unsigned statusCode;
+        std::shared_ptr<const MessageBuilder> message;
+        std::chrono::steady_clock::time_point expires; // default: never
+    };
+
+    std::map<HttpRequestMethod, Handler> mHandlers;
+
+    HttpContentPolicy mContentPolicy;
+
+    bool mCacheEnabled = false;
+    std::chrono::steady_clock::duration mCacheTTL{};
+    // One entry for each path with its query and content coding, the body is cached the way it was sent
+    typedef std::array<std::shared_ptr<const CachedResponse>, 3> CachedPath;
+    std::map<std::string, CachedPath, std::less<>> mCached;
+#ifdef TINYHTTP_THREADING
+    std::mutex mCacheMutex; // held to copy or replace an entry, never while sending
+#endif
+
+    bool mCompress          = false;
+    size_t mCompressMinSize = TINYHTTP_COMPRESS_MIN_SIZE;
+
+    static bool isSafeFilename(const std::string &name, bool allowSlash);
+    static std::string_view getMimeType(std::string_view name) noexcept;
+    static HttpResponse serveStaticFile(const std::string &path, const HttpRequest &req);
+
+    HttpHandlerBuilder *handle(HttpRequestMethod method, Handler h) {
+        mHandlers.insert(std::pair<HttpRequestMethod, Handler>(method, std::move(h)));
         return this;
     }
 
+    std::shared_ptr<const CachedResponse> findCached(std::string_view path, ContentCoding coding);
+
+    // Stores a response the way it is sent for the following requests to the same path
+    void storeCached(std::string_view path, HttpResponse &res, ContentCoding coding, std::chrono::steady_clock::time_point now);
+
+    // Compresses and caches what a coroutine handler returned, like process() does for the others
+    HttpTask<HttpResponse> finishAsync(HttpTask<HttpResponse> handler, std::string path, ContentCoding coding, bool cache);
+
+public:
+    HttpHandlerBuilder *posted(HandlerFunc h) {
+        return handle(HttpRequestMethod::POST, {std::move(h), {}});
+    }
+
+    HttpHandlerBuilder *requested(HandlerFunc h) {
+        return handle(HttpRequestMethod::GET, {std::move(h), {}});
+    }
+
+    // Coroutine handlers, the request stays valid until they are done:
+    //   ->requested([](const HttpRequest &req) -> HttpTask<HttpResponse> { ... co_return HttpResponse{200}; })
+    HttpHandlerBuilder *posted(AsyncHandlerFunc h) {
+        return handle(HttpRequestMethod::POST, {{}, std::move(h)});
+    }
+
+    HttpHandlerBuilder *requested(AsyncHandlerFunc h) {
+        return handle(HttpRequestMethod::GET, {{}, std::move(h)});
+    }
+
+    // Files are answered from a shared cache with ETag and Last-Modified, conditional
+    // requests get a 304 and a single Range is served as a 206
     HttpHandlerBuilder *serveFile(std::string name) {
-        return requested([name](const HttpRequest &) {
-            std::ifstream t(name);
-            if (t.is_open())
-                return HttpResponse{200, getMimeType(name), std::string((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>())};
-            else {
-                std::cerr << "Could not locate file: " << name << std::endl;
-                return HttpResponse{404, "text/plain", "The requested file is missing from the server"};
-            }
+        return requested([name](const HttpRequest &q) {
+            return serveStaticFile(name, q);
         });
     }
 
     HttpHandlerBuilder *serveFromFolder(std::string dir) {
         return requested([dir](const HttpRequest &q) {
-            std::string fname = q.getPath();
-            fname             = fname.substr(fname.rfind('/') + 1);
-
-            if (isSafeFilename(fname, false)) {
-                fname = dir + "/" + fname;
+            std::string fname{q.getPath()};
+            fname = fname.substr(fname.rfind('/') + 1);
 
-                std::ifstream t(fname);
-                if (t.is_open())
-                    return HttpResponse{200, getMimeType(fname), std::string((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>())};
-                else
-                    std::cerr << "Could not locate file: " << fname << std::endl;
-            }
+            if (isSafeFilename(fname, false))
+                return serveStaticFile(dir + "/" + fname, q);
 
             return HttpResponse{404, "text/plain", "The requested file is missing from the server"};
         });
@@ -437,61 +1760,413 @@ public:
 
     template<typename T>
     inline HttpHandlerBuilder *posted(T x) {
-        return posted(HandlerFunc(std::move(x)));
+        if constexpr (std::is_invocable_r_v<HttpTask<HttpResponse>, T &, const HttpRequest &>)
+            return posted(AsyncHandlerFunc(std::move(x)));
+        else
+            return posted(HandlerFunc(std::move(x)));
     }
 
     template<typename T>
     inline HttpHandlerBuilder *requested(T x) {
-        return requested(HandlerFunc(std::move(x)));
+        if constexpr (std::is_invocable_r_v<HttpTask<HttpResponse>, T &, const HttpRequest &>)
+            return requested(AsyncHandlerFunc(std::move(x)));
+        else
+            return requested(HandlerFunc(std::move(x)));
+    }
+
+    // Serializes the first successful GET response for a path and query and sends the same
+    // bytes for every following GET to them, no matter the headers. Routes with parameters keep
+    // one for each path they matched. A zero ttl keeps them until invalidateCache() is called
+    HttpHandlerBuilder *cacheFor(std::chrono::steady_clock::duration ttl = {}) {
+        mCacheEnabled = true;
+        mCacheTTL     = ttl;
+        return this;
     }
 
-    std::unique_ptr<HttpResponse> process(const HttpRequest &req) override {
-        auto h = mHandlers.find(req.getMethod());
+    inline void invalidateCache() {
+#ifdef TINYHTTP_THREADING
+        std::lock_guard lock{mCacheMutex};
+#endif
+
+        mCached.clear();
+    }
 
-        if (h == mHandlers.end())
-            return std::make_unique<HttpResponse>(405, "text/plain", "405 method not allowed");
-        else
-            return std::make_unique<HttpResponse>(h->second(req));
+#ifdef TINYHTTP_COMPRESSION
+    // Compresses responses of at least minSize bytes, and all streamed ones, for clients that
+    // accept gzip or deflate. Files aren't compressed since ranges don't mix with it, htpack
+    // bundles carry their own gzip variant
+    HttpHandlerBuilder *compress(size_t minSize = TINYHTTP_COMPRESS_MIN_SIZE) {
+        mCompress        = true;
+        mCompressMinSize = minSize;
+        return this;
     }
+#endif
+
+    // Bodies over this size are answered with 413, MAX_HTTP_CONTENT_SIZE by default
+    HttpHandlerBuilder *maxContentSize(size_t bytes) {
+        mContentPolicy.maxSize = bytes;
+        return this;
+    }
+
+    // The handlers read the body themselves with HttpRequest::readContent() instead of
+    // getting it buffered in content()
+    HttpHandlerBuilder *streamContent() {
+        mContentPolicy.streamed = true;
+        return this;
+    }
+
+    HttpContentPolicy contentPolicy() const noexcept override {
+        return mContentPolicy;
+    }
+
+    std::shared_ptr<HttpResponse> process(const HttpRequest &req) override;
+};
+
+// A file of a bundle generated by htpack, every variant is a complete response
+struct HttpAsset {
+    const char *path; // relative to the bundled directory
+    const char *etag; // quoted hash of the content
+    SendSlice identity, gzip, notModified; // gzip is empty if it wouldn't be smaller
+};
+
+// Answers with one of the prebuilt responses of an asset, nothing is built per request
+class HttpAssetHandler : public HandlerBuilder {
+    const HttpAsset &mAsset;
+
+public:
+    HttpAssetHandler(const HttpAsset &asset) : mAsset{asset} {}
+
+    std::shared_ptr<HttpResponse> process(const HttpRequest &req) override;
+};
+
+// Maps request paths to handlers. Plain paths are found with a single hash lookup, paths
+// with parameters ("/title/{id:hex}", "/remote/key/{button}", "/files/{path*}") are matched
+// one segment at a time in a prefix tree, so neither depends on the number of routes.
+// Literal segments win over parameters, see PathParamType for the order of those
+class HttpRouter {
+public:
+    typedef std::vector<std::shared_ptr<HandlerBuilder>> Handlers;
+
+    // Throws on malformed parameters, handlers added with first = true are tried before the others
+    void add(std::string_view pattern, std::shared_ptr<HandlerBuilder> handler, bool first = false);
+
+    // Returns the handlers of the best matching route or nullptr, params is overwritten
+    const Handlers *match(std::string_view path, std::vector<PathParam> &params) const;
+
+private:
+    struct StringHash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view s) const noexcept {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    template<typename T>
+    using StringMap = std::unordered_map<std::string, T, StringHash, std::equal_to<>>;
+
+    struct Node {
+        PathParamType type = PathParamType::STRING; // of the segment leading here, unless it's a literal
+        std::string name;                          // parameter name
+
+        StringMap<std::unique_ptr<Node>> literals;
+        std::vector<std::unique_ptr<Node>> params; // sorted by type
+        Handlers handlers;
+    };
+
+    StringMap<Handlers> mStatic;
+    Node mRoot;
+
+    static void addTo(Handlers &handlers, std::shared_ptr<HandlerBuilder> handler, bool first);
+    static const Handlers *matchNode(const Node &node, std::string_view path, size_t pos, std::vector<PathParam> &params);
+};
+
+#ifdef TINYHTTP_REACTOR
+class HttpWorkerPool {
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mQueue;
+    std::mutex mMutex;
+    std::condition_variable mTaskAvailable;
+    size_t mMaxQueued;
+    bool mStopping = false;
+
+    void workerThreadProc();
+
+public:
+    HttpWorkerPool(size_t threads, size_t maxQueued);
+    HttpWorkerPool(const HttpWorkerPool &) = delete;
+    ~HttpWorkerPool() { stop(); }
+
+    // Returns false without queueing the task if the queue is full or the pool is shutting down
+    bool trySubmit(std::function<void()> task);
+
+    // Queues the task even if the queue is full, for work that was accepted before, like a
+    // handler that continues. Returns false if the pool is shutting down
+    bool post(std::function<void()> task);
+    size_t queueDepth();
+    void stop();
+};
+#endif
+
+#ifdef TINYHTTP_THREADING
+// Keeps the connection deadlines. Timers sit in four wheels of 64 slots, the first covering the
+// next 64 ticks and each further one 64 times as many, and move down to a finer wheel as they
+// get closer. Adding, moving and removing a timer is O(1), and the timer thread only wakes
+// up when a slot is due, or not at all while no timer is set
+class HttpTimerWheel {
+public:
+    class Timer {
+        friend class HttpTimerWheel;
+
+        Timer **mLink = nullptr; // the pointer to this timer in its slot, null if not scheduled
+        Timer *mNext  = nullptr;
+        uint64_t mExpires;
+        uint8_t mLevel;
+
+    public:
+        Timer()              = default;
+        Timer(const Timer &) = delete;
+        virtual ~Timer()     = default;
+
+        // Runs on the timer thread with the wheel locked, so it must not use the wheel
+        virtual void onTimerExpired() = 0;
+    };
+
+    HttpTimerWheel();
+    HttpTimerWheel(const HttpTimerWheel &) = delete;
+    ~HttpTimerWheel();
+
+    // (Re)schedules a timer, timeouts longer than the wheels can hold are shortened
+    void schedule(Timer &timer, std::chrono::steady_clock::duration timeout);
+    void cancel(Timer &timer);
+
+private:
+    static constexpr unsigned kLevels   = 4;
+    static constexpr unsigned kSlotBits = 6;
+    static constexpr uint64_t kSlots    = 1 << kSlotBits;
+
+    typedef std::chrono::duration<int64_t, std::ratio<TINYHTTP_TIMER_TICK, 1000>> Tick;
+
+    Timer *mSlots[kLevels][kSlots]  = {};
+    size_t mLevelCounts[kLevels]    = {};
+    uint64_t mCurrentTick           = 0;
+    uint64_t mWakeTick              = UINT64_MAX; // when the timer thread wakes up next
+    const std::chrono::steady_clock::time_point mEpoch = std::chrono::steady_clock::now();
+
+    std::mutex mMutex;
+    std::condition_variable mChanged;
+    bool mStopping = false;
+    std::thread mThread;
+
+    uint64_t currentTick() const;
+    bool empty() const noexcept;
+    void link(Timer &timer);
+    void unlink(Timer &timer);
+    void advanceTo(uint64_t tick);
+    uint64_t nextEventTick() const;
+    void timerThreadProc();
+};
+#endif
+
+struct HttpListenOptions {
+    int backlog            = TINYHTTP_LISTEN_BACKLOG;
+    unsigned acceptThreads = TINYHTTP_ACCEPT_THREADS; // each with its own SO_REUSEPORT socket
 };
 
 class HttpServer {
-    std::vector<std::pair<std::string, std::shared_ptr<HandlerBuilder>>> mHandlers;
+    HttpRouter mRouter;
     std::vector<std::pair<std::regex, std::shared_ptr<HandlerBuilder>>> mReHandlers;
-    MessageBuilder mDefault404Message, mDefault400Message;
-    int mSocket                 = -1;
-    bool mCleanupThreadShutdown = false;
+    MessageBuilder mDefault404Message, mDefault503Message;
+    std::shared_ptr<HttpResponse> mDefault400Response, mDefault413Response, mDefault500Response;
+    int mSocket = -1;
+
+    // Sockets of the additional accept threads, closed once the listen loop exits
+    std::vector<int> mAcceptorSockets;
+#ifdef TINYHTTP_THREADING
+    std::mutex mAcceptorMutex;
+#endif
+
+    // The body is read the way the first handler that gets the request wants it
+    static std::shared_ptr<HttpResponse> invokeHandler(HandlerBuilder &handler, HttpRequest &req) {
+        if (!req.mContentReceived)
+            req.receiveContent(handler.contentPolicy());
+
+#ifdef TINYHTTP_TRACING
+        auto start = std::chrono::steady_clock::now();
+        auto res   = handler.process(req);
+        req.mTrace.add(HttpTrace::HANDLER, start);
+        return res;
+#else
+        return handler.process(req);
+#endif
+    }
+
+    // metrics is set to where the request is counted, null while metrics are disabled
+    std::shared_ptr<HttpResponse> processRequest(HttpRequest &req, HttpRouteMetrics *&metrics) {
+        std::string_view key = req.getPath();
 
-    std::shared_ptr<HttpResponse> processRequest(std::string key, const HttpRequest &req) {
         try {
-            for (auto &x : mHandlers)
-                if (x.first == key) {
-                    auto res = x.second->process(req);
+#ifdef TINYHTTP_TRACING
+            auto routingStart = std::chrono::steady_clock::now();
+            auto handlers     = mRouter.match(key, req.mParams);
+            req.mTrace.add(HttpTrace::ROUTING, routingStart);
+
+            if (handlers)
+#else
+            if (auto handlers = mRouter.match(key, req.mParams))
+#endif
+                for (auto &x : *handlers) {
+                    metrics  = x->metrics;
+                    auto res = invokeHandler(*x, req);
                     if (res) return res;
                 }
 
-            for (auto x : mReHandlers)
-                if (std::regex_match(key, x.first)) {
-                    auto res = x.second->process(req);
+            // regular expressions are only tried if no route matched
+            for (auto &x : mReHandlers)
+                if (std::regex_match(key.begin(), key.end(), x.first)) {
+                    metrics  = x.second->metrics;
+                    auto res = invokeHandler(*x.second, req);
                     if (res) return res;
                 }
+        } catch (HttpRequestError &e) {
+            return e.statusCode == 413 ? mDefault413Response : mDefault400Response;
         } catch (std::exception &e) {
             std::cerr << "Exception while handling request (" << key << "): " << e.what() << std::endl;
-            return std::make_shared<HttpResponse>(500, "text/plain", "500 exception while processing");
+            return mDefault500Response;
         }
 
+        metrics = mMetrics ? &mMetrics->unmatched : nullptr;
         return nullptr;
     }
 
+    // How the handler that gets the request first wants its body read, known before the body arrives
+    HttpContentPolicy contentPolicyFor(HttpRequest &req) {
+        std::string_view key = req.getPath();
+
+        if (auto handlers = mRouter.match(key, req.mParams); handlers && !handlers->empty())
+            return handlers->front()->contentPolicy();
+
+        for (auto &x : mReHandlers)
+            if (std::regex_match(key.begin(), key.end(), x.first))
+                return x.second->contentPolicy();
+
+        return {};
+    }
+
+    // Per route counters, made by enableMetrics(). Routes are remembered with their label until then
+    struct Metrics {
+        std::list<HttpRouteMetrics> routes;
+        HttpRouteMetrics unmatched{"(unmatched)"};
+    };
+
+    std::unique_ptr<Metrics> mMetrics;
+    std::vector<std::pair<std::string, HandlerBuilder *>> mRouteLabels;
+    std::atomic<size_t> mActiveHandovers{0};
+
+    void addRouteLabel(std::string label, HandlerBuilder &handler);
+    HttpRouteMetrics &routeMetrics(const std::string &label);
+    std::string renderMetrics();
+
+#ifdef TINYHTTP_TRACING
+    // The slowest traces since the log was cleared, made by enableTracing()
+    struct TraceLog {
+        std::vector<HttpTrace> slowest; // a heap with the fastest of them on top
+        std::atomic<uint32_t> thresholdMicros{0}; // what it takes to get in once the log is full
+        bool serverTiming = false;
+#ifdef TINYHTTP_THREADING
+        std::mutex mutex;
+#endif
+    };
+
+    std::unique_ptr<TraceLog> mTraceLog;
+
+    void logTrace(const HttpTrace &trace);
+    void clearTraces();
+    std::string renderTraces();
+#endif
+
     class Processor : public std::enable_shared_from_this<Processor> {
         std::shared_ptr<IClientStream> mClientStream;
         HttpServer &mOwner;
-        std::chrono::system_clock::time_point mLastActive;
-        bool mIsAlive, mHasHandover;
+
+        // Read by the reactor's I/O threads while a worker, a handover or the timers change them
+        std::atomic<bool> mIsAlive{true}, mHasHandover{false};
+
+        ICanRequestProtocolHandover *mHandover = nullptr;
+        std::unique_ptr<HttpRequest> mHandoverRequest;
+
+        // Responses are made in here while their request is handled. Declared before everything
+        // that holds them, so it goes last
+        HttpArena mArena;
+
+        // Reused for every request on this connection to keep their buffers around
+        HttpRequest mRequest;
+
+        // The head in mRequest was read ahead, by the reactor or while looking for pipelined requests,
+        // and waits to be answered. The policy is its route's, for reading the body ahead as well
+        bool mHeadReceived = false, mHeadValid = false;
+        HttpContentPolicy mContentPolicy;
+
+        // Responses of pipelined requests, sent together by flushResponses(). Heads and small
+        // bodies are collected in mSendBuffer, larger bodies are sent from their owner
+        MessageBuilder mSendBuffer;
+        std::vector<std::shared_ptr<HttpResponse>> mPendingResponses;
+        std::vector<std::pair<size_t, SendSlice>> mPendingBodies; // send buffer offset, body
+        std::vector<SendSlice> mSendSlices;
+        size_t mPendingCount = 0;
+        bool mPendingNoDelay = true;
+
+        // A streamed response that is waiting for the client to catch up, later requests wait behind it
+        std::shared_ptr<HttpResponse> mStreamingResponse;
+        bool mStreamKeepAlive = false;
+
+        // Stands in for the response of a coroutine handler until it is done, nothing else is read meanwhile
+        std::shared_ptr<HttpResponse> mDeferredResponse;
+
+        // Route of the current request and of the streamed response while metrics are enabled
+        HttpRouteMetrics *mRequestMetrics = nullptr, *mStreamingMetrics = nullptr;
+        std::chrono::steady_clock::time_point mRequestStart;
+
+#ifdef TINYHTTP_TRACING
+        // Traces of the queued responses while tracing is enabled, finished once they were sent
+        std::vector<HttpTrace> mPendingTraces;
+        std::chrono::steady_clock::time_point mDeferredSince;
+#endif
+
+        bool mCloseWhenSent = false;
+        std::atomic<bool> mOutputWatched{false};
+
+        void queueResponse(SendSlice data);
+        void flushResponses();
+
+        // Counts the current request once its response is queued
+        void recordRequest(unsigned statusCode, uint64_t bytesOut);
+
+#ifdef TINYHTTP_TRACING
+        void setServerTiming(HttpResponse &res);
+#endif
+
+        // Queues the response of the current request once its handler is done, returns false
+        // if the connection shouldn't be reused
+        bool respond(std::shared_ptr<HttpResponse> res);
+
+        void receiveHead();
+
+        // Runs the coroutine handler on this thread until it is done
+        void runDeferred();
 
 #ifdef TINYHTTP_THREADING
         std::unique_ptr<std::thread> mWorkThread;
         std::mutex mShutdownMutex;
+
+        struct DeadlineTimer : HttpTimerWheel::Timer {
+            Processor &owner;
+
+            DeadlineTimer(Processor &owner) : owner{owner} {}
+            void onTimerExpired() override { owner.interrupt(); }
+        } mDeadline{*this};
+
+        std::list<Processor *>::iterator mListEntry;
 #endif
 
     public:
@@ -499,64 +2174,180 @@ class HttpServer {
 
         Processor(std::shared_ptr<IClientStream> stream, HttpServer &owner);
 
-        ~Processor() {
-            shutdown();
+        // Reads and answers a single request, the response is only queued. readable tells if
+        // the client is known to be sending, otherwise the idle timeout applies until the head
+        // starts arriving. Returns false if the connection shouldn't be reused
+        bool serveRequest(bool readable);
+
+        // Answers the next request and every further one that was already received completely,
+        // then sends all responses with one write. Returns false if the connection shouldn't be reused.
+        // A streamed response that stopped early is continued first
+        bool serveRequests(bool readable);
+        void runHandover();
+
+        // Reads what the client sent without waiting. Returns true once the next request can be answered
+        // without waiting for the client: its head is complete, and so is its body unless the route streams
+        // it or it is chunked. Throws once the client closed the connection
+        bool receiveRequest();
+
+        // Like receiveRequest(), but false if the connection closed, its thread finds out when it reads next
+        bool hasNextRequest() noexcept;
+
+        // Answers a request no worker can take with a 503, the connection closes once it was sent
+        void rejectBusy();
+
+        // Sends more of the streamed response, returns false if the connection shouldn't be reused
+        bool continueStreaming();
+
+        inline bool isStreaming() const noexcept {
+            return mStreamingResponse != nullptr;
+        }
+
+        inline bool isDeferred() const noexcept {
+            return mDeferredResponse != nullptr;
+        }
+
+        // Runs the coroutine handler until it is done or waits for something. Returns true if it is done,
+        // otherwise done() is called by the thread that finishes it. Until then the connection belongs
+        // to the handler, done() may hand it to another thread right away
+        bool startDeferred(std::function<void()> done);
+
+        // Queues the response of the coroutine handler once it is done, returns false if the connection
+        // shouldn't be reused
+        bool finishDeferred();
+
+        // Whether the connection closes once the client took the pending output, instead of waiting for a request
+        inline bool closeWhenSent() const noexcept {
+            return mCloseWhenSent;
+        }
+
+        inline void setCloseWhenSent(bool close) noexcept {
+            mCloseWhenSent = close;
+        }
+
+        // Keeps the reactor from watching the output of a handed over connection twice,
+        // returns false if it is already watched
+        inline bool markOutputWatched() noexcept {
+            return !mOutputWatched.exchange(true);
+        }
+
+        inline void clearOutputWatched() noexcept {
+            mOutputWatched = false;
+        }
+
+        enum class Deadline {
+            IDLE, // waiting for the next request
+            HEAD, // reading a request head
+            BODY, // reading a request body
+            SEND, // waiting for the client to take the pending output
+        };
+
+        // Interrupts the connection if it's still in this state once the matching timeout passed
+        void setDeadline(Deadline which);
+        void clearDeadline();
+
+        inline bool wantsHandover() const noexcept {
+            return mHandover != nullptr;
+        }
+
+        inline bool hasHandover() const noexcept {
+            return mHasHandover;
+        }
+
+        inline IClientStream &stream() noexcept {
+            return *mClientStream;
         }
 
+        ~Processor();
+
         inline bool isAlive() const noexcept {
             return mIsAlive;
         }
-        bool isTimedOut() const noexcept;
         void shutdown();
 
+        // Like shutdown(), but leaves closing the connection to the thread that uses it
+        void interrupt();
+
 #ifdef TINYHTTP_THREADING
         void startThread();
+        void startHandoverThread();
 #endif
     };
 
 #ifdef TINYHTTP_THREADING
-    void cleanupThreadProc();
+    HttpTimerWheel mTimers;
 
-    std::unique_ptr<std::thread> mCleanupThread;
-    std::list<std::shared_ptr<Processor>> mRequestProcessors;
-    std::mutex mRequestProcessorListMutex;
+    // Every open connection, they add and remove themselves
+    std::list<Processor *> mProcessors;
+    std::mutex mProcessorListMutex;
 #else
     std::shared_ptr<Processor> mCurrentProcessor;
 #endif
 
+#ifdef TINYHTTP_REACTOR
+    class Reactor;
+
+    bool mUseReactor = true;
+
+    // The reactor of the running listen loop, for the metrics
+    std::weak_ptr<Reactor> mReactor;
+    std::mutex mReactorMutex;
+#endif
+
 public:
     HttpServer();
     ~HttpServer() {
-        mCleanupThreadShutdown = true;
         shutdown();
-
-#ifdef TINYHTTP_THREADING
-        if (mCleanupThread->joinable())
-            mCleanupThread->join();
-#endif
     }
 
 #ifdef TINYHTTP_WS
     std::shared_ptr<WebsockHandlerBuilder> websocket(std::string path) {
         auto h = std::make_shared<WebsockHandlerBuilder>();
-        mHandlers.insert(mHandlers.begin(), std::pair<std::string, std::shared_ptr<WebsockHandlerBuilder>>{std::move(path), h});
+        mRouter.add(path, h, true);
+        addRouteLabel(std::move(path), *h);
         return h;
     }
 #endif
 
+    // Besides plain paths this takes {name}, {name:int} and {name:hex} segments
+    // and a trailing {name*} or * segment, see HttpRequest::param for their values
     std::shared_ptr<HttpHandlerBuilder> when(std::string path) {
         auto h = std::make_shared<HttpHandlerBuilder>();
-        mHandlers.push_back(std::pair<std::string, std::shared_ptr<HttpHandlerBuilder>>{std::move(path), h});
+        mRouter.add(path, h);
+        addRouteLabel(std::move(path), *h);
         return h;
     }
 
     std::shared_ptr<HttpHandlerBuilder> whenMatching(std::string path) {
         auto h = std::make_shared<HttpHandlerBuilder>();
-        mReHandlers.push_back(std::pair<std::regex, std::shared_ptr<HttpHandlerBuilder>>{std::regex{std::move(path)}, h});
+        mReHandlers.push_back(std::pair<std::regex, std::shared_ptr<HttpHandlerBuilder>>{std::regex{path}, h});
+        addRouteLabel(std::move(path), *h);
         return h;
     }
 
-    void startListening(uint16_t port);
+    // Serves a bundle generated by htpack below prefix, with "/static" app.js is served as
+    // /static/app.js. An index.html also answers for its directory
+    void serveAssets(std::string_view prefix, std::span<const HttpAsset> assets);
+
+#ifdef TINYHTTP_REACTOR
+    // Switches between the reactor and a thread per connection, takes effect on the next startListening
+    void setReactorEnabled(bool enabled) noexcept { mUseReactor = enabled; }
+#endif
+
+    // Counts requests, status classes, bytes and latencies for every route and serves them together
+    // with the open connections, handovers and the worker queue in the Prometheus text format
+    // at path. Call it before startListening, requests that match no route count as "(unmatched)"
+    std::shared_ptr<HttpHandlerBuilder> enableMetrics(std::string path = "/metrics");
+
+#ifdef TINYHTTP_TRACING
+    // Keeps the TINYHTTP_TRACE_LOG_SIZE slowest requests with the time each phase took, served as
+    // JSON at path. A POST to it clears them. With serverTiming, responses carry a Server-Timing
+    // header with the phases up to the handler. Call it before startListening
+    std::shared_ptr<HttpHandlerBuilder> enableTracing(std::string path = "/traces", bool serverTiming = false);
+#endif
+
+    // Accepts connections until shutdown() is called, blocks the calling thread
+    void startListening(uint16_t port, HttpListenOptions options = {});
     void shutdown();
 };
 
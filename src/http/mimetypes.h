@@ -0,0 +1,53 @@
+#ifndef HTTP_MIMETYPES_H
+#define HTTP_MIMETYPES_H
+
+#include <string_view>
+#include <utility>
+
+// Looked up by extension, case-insensitively. Shared by the server and htpack,
+// so bundled assets get the same types as files served from disk
+inline constexpr std::pair<std::string_view, std::string_view> kMimeTypes[] = {
+        {"css", "text/css"},
+        {"gif", "image/gif"},
+        {"gz", "application/gzip"},
+        {"htm", "text/html"},
+        {"html", "text/html"},
+        {"ico", "image/x-icon"},
+        {"jpeg", "image/jpeg"},
+        {"jpg", "image/jpeg"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"mjs", "application/javascript"},
+        {"pdf", "application/pdf"},
+        {"png", "image/png"},
+        {"svg", "image/svg+xml"},
+        {"txt", "text/plain"},
+        {"wasm", "application/wasm"},
+        {"webp", "image/webp"},
+        {"woff2", "font/woff2"},
+        {"xml", "application/xml"},
+};
+
+constexpr std::string_view lookupMimeType(std::string_view name) noexcept {
+    auto lower = [](char ch) { return (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch + ('a' - 'A')) : ch; };
+
+    size_t pos = name.rfind('.');
+    if (pos == std::string_view::npos)
+        return "application/octet-stream";
+
+    std::string_view ext = name.substr(pos + 1);
+    for (auto &[extension, type] : kMimeTypes) {
+        if (extension.size() != ext.size())
+            continue;
+
+        size_t i = 0;
+        while (i < ext.size() && extension[i] == lower(ext[i])) i++;
+
+        if (i == ext.size())
+            return type;
+    }
+
+    return "application/octet-stream";
+}
+
+#endif
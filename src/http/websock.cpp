@@ -1,6 +1,18 @@
 #include "http.hpp"
 
+#include <algorithm>
 #include <sys/socket.h>
+
+#ifdef TINYHTTP_COMPRESSION
+#include <zlib.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifndef TINYHTTP_WS
 #warning "You are compiling websock.cpp but you haven't enabled TINYHTTP_WS, please check your build system"
 #endif
@@ -190,228 +202,835 @@ namespace base64 {
     }
 } // namespace base64
 
-std::unique_ptr<HttpResponse> WebsockHandlerBuilder::process(const HttpRequest &req) {
-    if (req["Connection"].find("Upgrade") != std::string::npos) {
-        std::string upgrade = req["Upgrade"];
+#ifdef TINYHTTP_COMPRESSION
+// Raw deflate as permessage-deflate (RFC 7692) uses it. Every message ends with a sync flush,
+// whose 00 00 ff ff trailer isn't sent
+class WebsockDeflater {
+    z_stream mStream{};
+
+public:
+    explicit WebsockDeflater(int windowBits) {
+        if (deflateInit2(&mStream, TINYHTTP_COMPRESS_LEVEL, Z_DEFLATED, -windowBits, 6, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+    }
+
+    ~WebsockDeflater() {
+        deflateEnd(&mStream);
+    }
+
+    WebsockDeflater(const WebsockDeflater &)            = delete;
+    WebsockDeflater &operator=(const WebsockDeflater &) = delete;
+
+    // For connections without context takeover, one per window size
+    static WebsockDeflater &forThread(int windowBits) {
+        thread_local std::unique_ptr<WebsockDeflater> deflaters[16];
+
+        auto &deflater = deflaters[windowBits];
+        if (!deflater)
+            deflater = std::make_unique<WebsockDeflater>(windowBits);
+
+        return *deflater;
+    }
+
+    void reset() noexcept {
+        deflateReset(&mStream);
+    }
+
+    // Replaces out with the compressed message
+    void compress(const void *data, size_t size, std::vector<uint8_t> &out) {
+        mStream.next_in  = static_cast<Bytef *>(const_cast<void *>(data));
+        mStream.avail_in = size;
+        out.clear();
+
+        do {
+            size_t pos  = out.size();
+            size_t room = std::max<size_t>(deflateBound(&mStream, mStream.avail_in), 64);
+            out.resize(pos + room);
+
+            mStream.next_out  = out.data() + pos;
+            mStream.avail_out = room;
+
+            if (deflate(&mStream, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+                throw std::runtime_error("deflate failed");
+
+            out.resize(pos + room - mStream.avail_out);
+        } while (mStream.avail_in > 0 || mStream.avail_out == 0);
+
+        // An empty message right after a flush gives no output at all, an empty stored block stands in for it
+        if (out.size() >= 4)
+            out.resize(out.size() - 4);
+        else
+            out.assign(1, 0x00);
+    }
+};
+
+class WebsockInflater {
+    z_stream mStream{};
+
+public:
+    explicit WebsockInflater(int windowBits) {
+        if (inflateInit2(&mStream, -windowBits) != Z_OK)
+            throw std::runtime_error("inflateInit2 failed");
+    }
+
+    ~WebsockInflater() {
+        inflateEnd(&mStream);
+    }
+
+    WebsockInflater(const WebsockInflater &)            = delete;
+    WebsockInflater &operator=(const WebsockInflater &) = delete;
+
+    static WebsockInflater &forThread(int windowBits) {
+        thread_local std::unique_ptr<WebsockInflater> inflaters[16];
+
+        auto &inflater = inflaters[windowBits];
+        if (!inflater)
+            inflater = std::make_unique<WebsockInflater>(windowBits);
+
+        return *inflater;
+    }
+
+    void reset() noexcept {
+        inflateReset(&mStream);
+    }
+
+    // Replaces out with the message, false if it isn't valid or larger than maxSize
+    bool decompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, size_t maxSize) {
+        static const uint8_t kFlushTrailer[] = {0x00, 0x00, 0xff, 0xff};
+        const std::pair<const uint8_t *, size_t> inputs[] = {{data, size}, {kFlushTrailer, sizeof(kFlushTrailer)}};
+
+        out.clear();
+
+        for (auto [input, inputSize] : inputs) {
+            mStream.next_in  = const_cast<Bytef *>(input);
+            mStream.avail_in = inputSize;
+
+            do {
+                size_t pos  = out.size();
+                size_t room = std::min<size_t>(std::max<size_t>(inputSize * 4, 256), maxSize + 1 - pos);
+                out.resize(pos + room);
+
+                mStream.next_out  = out.data() + pos;
+                mStream.avail_out = room;
+
+                int result = inflate(&mStream, Z_SYNC_FLUSH);
+                out.resize(pos + room - mStream.avail_out);
+
+                if (out.size() > maxSize || (result != Z_OK && result != Z_BUF_ERROR && result != Z_STREAM_END))
+                    return false;
+
+                // A final block ends the stream, the next message starts a new one
+                if (result == Z_STREAM_END) {
+                    inflateReset(&mStream);
+                    return true;
+                }
+
+                if (result == Z_BUF_ERROR && mStream.avail_in > 0 && mStream.avail_out > 0)
+                    return false;
+            } while (mStream.avail_in > 0 || mStream.avail_out == 0);
+        }
+
+        return true;
+    }
+};
+
+// permessage-deflate as negotiated for a connection
+struct WebsockDeflate {
+    int serverWindowBits = TINYHTTP_COMPRESS_WINDOW_BITS, clientWindowBits = 15;
+    bool serverTakeover = true, clientTakeover = true;
+    size_t minSize = 0;
+
+    // The connection's own streams, only made with context takeover and once they are needed
+    std::unique_ptr<WebsockDeflater> deflater;
+    std::unique_ptr<WebsockInflater> inflater;
+#ifdef TINYHTTP_THREADING
+    std::mutex mutex; // held while compressing and sending, the client has to see messages in that order
+#endif
+
+    bool compresses(uint8_t opcode, size_t length) const noexcept {
+        return (opcode == WSOPC_TEXT || opcode == WSOPC_BINARY) && length >= minSize;
+    }
+
+    bool inflate(std::span<const uint8_t> in, std::vector<uint8_t> &out) {
+        if (!clientTakeover) {
+            WebsockInflater &threadInflater = WebsockInflater::forThread(clientWindowBits);
+            threadInflater.reset();
+            return threadInflater.decompress(in.data(), in.size(), out, MAX_ALLOWED_WS_FRAME_LENGTH);
+        }
+
+        if (!inflater)
+            inflater = std::make_unique<WebsockInflater>(clientWindowBits);
+
+        return inflater->decompress(in.data(), in.size(), out, MAX_ALLOWED_WS_FRAME_LENGTH);
+    }
+};
+
+// Accepts the first permessage-deflate offer of a Sec-WebSocket-Extensions value that can be served and
+// returns the extension for the response, empty if there is none. Offers with unknown, repeated or
+// invalid parameters are skipped, as are 256 byte windows, which zlib can't deflate with
+static std::string negotiateDeflate(std::string_view offers, bool contextTakeover, WebsockDeflate &deflate) {
+    auto trim = [](std::string_view str) {
+        while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) str.remove_prefix(1);
+        while (!str.empty() && (str.back() == ' ' || str.back() == '\t')) str.remove_suffix(1);
+        return str;
+    };
+
+    while (!offers.empty()) {
+        size_t comma           = offers.find(',');
+        std::string_view offer = offers.substr(0, comma);
+        offers                 = comma == std::string_view::npos ? std::string_view{} : offers.substr(comma + 1);
+
+        size_t semicolon = offer.find(';');
+        if (trim(offer.substr(0, semicolon)) != "permessage-deflate")
+            continue;
+
+        std::string_view params = semicolon == std::string_view::npos ? std::string_view{} : offer.substr(semicolon + 1);
+        bool valid = true, serverNoTakeover = false, clientNoTakeover = false, clientMaxOffered = false;
+        int serverMax = 0, clientMax = 15;
+        unsigned seen = 0;
+
+        while (valid && !params.empty()) {
+            size_t next            = params.find(';');
+            std::string_view param = params.substr(0, next);
+            params                 = next == std::string_view::npos ? std::string_view{} : params.substr(next + 1);
+
+            size_t equals          = param.find('=');
+            bool hasValue          = equals != std::string_view::npos;
+            std::string_view name  = trim(param.substr(0, equals));
+            std::string_view value = hasValue ? trim(param.substr(equals + 1)) : std::string_view{};
+
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                value = value.substr(1, value.size() - 2);
+
+            int bits = 0;
+            if (hasValue) {
+                auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), bits);
+                valid             = error == std::errc{} && end == value.data() + value.size() && bits >= 8 && bits <= 15;
+            }
+
+            unsigned flag = 0;
+            if (name == "server_no_context_takeover" && !hasValue)
+                flag = 1, serverNoTakeover = true;
+            else if (name == "client_no_context_takeover" && !hasValue)
+                flag = 2, clientNoTakeover = true;
+            else if (name == "server_max_window_bits" && hasValue)
+                flag = 4, serverMax = bits;
+            else if (name == "client_max_window_bits")
+                flag = 8, clientMaxOffered = true, clientMax = hasValue ? bits : 15;
+
+            valid = valid && flag != 0 && !(seen & flag);
+            seen |= flag;
+        }
+
+        if (!valid || serverMax == 8)
+            continue;
+
+        deflate.serverWindowBits = std::min(serverMax ? serverMax : 15, TINYHTTP_COMPRESS_WINDOW_BITS);
+        deflate.clientWindowBits = clientMaxOffered ? std::min(clientMax, TINYHTTP_COMPRESS_WINDOW_BITS) : 15;
+        deflate.serverTakeover   = contextTakeover && !serverNoTakeover;
+        deflate.clientTakeover   = contextTakeover && !clientNoTakeover;
+
+        // Window sizes are answered only if they were offered, the client's one is lowered to save memory here
+        std::string extension = "permessage-deflate";
+        if (!deflate.serverTakeover)
+            extension += "; server_no_context_takeover";
+        if (!deflate.clientTakeover)
+            extension += "; client_no_context_takeover";
+        if (serverMax)
+            extension += "; server_max_window_bits=" + std::to_string(deflate.serverWindowBits);
+        if (clientMaxOffered)
+            extension += "; client_max_window_bits=" + std::to_string(deflate.clientWindowBits);
+
+        return extension;
+    }
+
+    return {};
+}
+#endif
+
+std::shared_ptr<HttpResponse> WebsockHandlerBuilder::process(const HttpRequest &req) {
+    if (req.header(HttpHeader::CONNECTION).find("Upgrade") != std::string_view::npos) {
+        std::string upgrade = req[HttpHeader::UPGRADE];
         if (upgrade != "websocket") {
             fprintf(stderr, "Received connection upgrade with unknown upgrade type: '%s'\n", upgrade.c_str());
-            return std::make_unique<HttpResponse>(400); // Send "400 Bad request"
+            return HttpArena::makeShared<HttpResponse>(400); // Send "400 Bad request"
         }
 
         HttpResponse res{101};
-        res["Upgrade"]    = "WebSocket";
-        res["Connection"] = "Upgrade";
+        res[HttpHeader::UPGRADE]    = "WebSocket";
+        res[HttpHeader::CONNECTION] = "Upgrade";
 
-        auto clientKey = req["Sec-WebSocket-Key"];
+        auto clientKey = req[HttpHeader::SEC_WEBSOCKET_KEY];
         if (!clientKey.empty()) {
             std::string accept = clientKey + WEBSCOK_MAGIC_UID;
             unsigned char hash[SHA1_DIGEST_LENGTH];
             hash_sha1(accept.data(), accept.length(), hash);
-            res["Sec-WebSocket-Accept"] = base64::encode(hash, SHA1_DIGEST_LENGTH);
+            res[HttpHeader::SEC_WEBSOCKET_ACCEPT] = base64::encode(hash, SHA1_DIGEST_LENGTH);
+        }
+
+#ifdef TINYHTTP_COMPRESSION
+        // acceptHandover() negotiates the same again from the request
+        if (mCompress) {
+            WebsockDeflate deflate;
+            std::string extension = negotiateDeflate(req.header(HttpHeader::SEC_WEBSOCKET_EXTENSIONS), mContextTakeover, deflate);
+
+            if (!extension.empty())
+                res[HttpHeader::SEC_WEBSOCKET_EXTENSIONS] = extension;
         }
+#endif
 
         res.requestProtocolHandover(this);
-        return std::make_unique<HttpResponse>(res);
+        return HttpArena::makeShared<HttpResponse>(std::move(res));
     }
 
     return HandlerBuilder::process(req);
 }
 
+void maskWebsockPayload(uint8_t *out, const uint8_t *in, size_t length, const uint8_t key[4]) noexcept {
+    // The key in memory order, repeated for the wider steps. They all start at a multiple of 4
+    uint32_t key32;
+    memcpy(&key32, key, 4);
+
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i vectorKey = _mm_set1_epi32(static_cast<int>(key32));
+    for (; i + 16 <= length; i += 16) {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_xor_si128(data, vectorKey));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t vectorKey = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+    for (; i + 16 <= length; i += 16)
+        vst1q_u8(out + i, veorq_u8(vld1q_u8(in + i), vectorKey));
+#endif
+
+    // Native words, 32 bits on the Wii U. The factor is 1 there and 2^32 + 1 for 64 bits, and memcpy
+    // keeps unaligned buffers legal while compiling to plain loads and stores
+    uintptr_t wordKey = key32 * (UINTPTR_MAX / UINT32_MAX);
+
+    for (; i + sizeof(uintptr_t) <= length; i += sizeof(uintptr_t)) {
+        uintptr_t word;
+        memcpy(&word, in + i, sizeof(word));
+        word ^= wordKey;
+        memcpy(out + i, &word, sizeof(word));
+    }
+
+    for (; i < length; i++)
+        out[i] = in[i] ^ key[i & 3];
+}
+
+bool WebsockFrameDecoder::next(Frame &frame) {
+    const uint8_t *head = mBuffer.data() + mStart;
+    size_t available    = mEnd - mStart;
+
+    if (available < 2)
+        return false;
+
+    bool masked            = !!(head[1] & 0x80);
+    uint64_t payloadLength = head[1] & 0x7F;
+    size_t headerLength    = 2 + (payloadLength == 126 ? 2 : payloadLength == 127 ? 8 : 0) + (masked ? 4 : 0);
+
+    if (available < headerLength)
+        return false;
+
+    if (payloadLength >= 126) {
+        size_t lengthBytes = payloadLength == 126 ? 2 : 8;
+        payloadLength      = 0;
+
+        for (size_t i = 0; i < lengthBytes; i++)
+            payloadLength = (payloadLength << 8) | head[2 + i];
+    }
+
+    if (payloadLength > MAX_ALLOWED_WS_FRAME_LENGTH)
+        throw std::runtime_error("WebSocket frame too large");
+
+    if (available < headerLength + payloadLength) {
+        mWanted = headerLength + payloadLength;
+        return false;
+    }
+
+    uint8_t *payload = mBuffer.data() + mStart + headerLength;
+
+    if (masked)
+        maskWebsockPayload(payload, payload, payloadLength, head + headerLength - 4);
+
+    frame.fin      = !!(head[0] & 0x80);
+    frame.masked   = masked;
+    frame.reserved = head[0] & 0x70;
+    frame.opcode   = head[0] & 0x0F;
+    frame.payload  = {payload, static_cast<size_t>(payloadLength)};
+
+    mStart += headerLength + payloadLength;
+    mWanted = 0;
+    return true;
+}
+
+bool WebsockFrameDecoder::fill(IClientStream &client) {
+    // What is left of the last read moves to the front, the buffer only grows for frames that don't fit it
+    if (mStart > 0) {
+        memmove(mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart);
+        mEnd -= mStart;
+        mStart = 0;
+    }
+
+    if (mWanted > mBuffer.size())
+        mBuffer.resize(mWanted);
+
+    size_t received = client.receive(mBuffer.data() + mEnd, mBuffer.size() - mEnd);
+    mEnd += received;
+
+    return received > 0;
+}
+
 void WebsockHandlerBuilder::acceptHandover(int &serverSock, IClientStream &client, std::unique_ptr<HttpRequest> srcRequest) {
-    uint8_t buffer[64], realOpc;
-    std::vector<uint8_t> contentBuffer;
-    bool fin, receivingFragment;
+    WebsockFrameDecoder decoder;
+    WebsockFrameDecoder::Frame frame;
+    std::vector<uint8_t> message;  // fragments of a message, and binary messages handed to the handler
+    std::vector<uint8_t> inflated; // compressed messages once inflated
+    uint8_t messageOpcode   = WSOPC_CONTINUATION;
+    bool receivingFragments = false;
+    [[maybe_unused]] bool messageCompressed = false;
+
+    std::unique_ptr<WebsockClientHandler> theClient{mFactory->makeInstance()};
+
+#ifdef TINYHTTP_COMPRESSION
+    if (mCompress && srcRequest) {
+        auto deflate = std::make_shared<WebsockDeflate>();
+
+        if (!negotiateDeflate(srcRequest->header(HttpHeader::SEC_WEBSOCKET_EXTENSIONS), mContextTakeover, *deflate).empty()) {
+            deflate->minSize    = mCompressMinSize;
+            theClient->mDeflate = std::move(deflate);
+        }
+    }
+#endif
 
-    auto theClient = mFactory->makeInstance();
     theClient->attachTcpStream(&client);
     theClient->attachRequest(std::move(srcRequest));
     theClient->onConnect();
 
     try {
         while (serverSock > 0 && client.isOpen()) {
-            receivingFragment = false;
-            contentBuffer.clear();
+            if (!decoder.next(frame)) {
+                if (!decoder.fill(client))
+                    break;
 
-            size_t totalLength = 0;
-            realOpc            = 0xff;
+                continue;
+            }
 
-            do {
-                if (client.receive(buffer, 2) == 0) {
-                    // TODO: this might break non-blocking sockets in the future
-                    goto websock_loop_exit;
-                }
+            if (!frame.masked) {
+                theClient->sendDisconnect(WSCLOSE_PROTOCOL_ERROR);
+                break;
+            }
 
-                uint8_t first  = buffer[0];
-                uint8_t second = buffer[1];
+            bool compressed = false;
+#ifdef TINYHTTP_COMPRESSION
+            // RSV1 marks the first frame of a compressed message once permessage-deflate was negotiated
+            compressed = frame.reserved == 0x40 && theClient->mDeflate && frame.opcode != WSOPC_CONTINUATION && !(frame.opcode & 0x08);
+#endif
 
-                fin      = !!(first & 0x80);
-                bool msk = !!(second & 0x80);
+            if (frame.reserved && !compressed) {
+                theClient->sendDisconnect();
+                break;
+            }
 
-                if (first & 0x70) {
+            // Control frames may come in between the fragments of a message
+            if (frame.opcode & 0x08) {
+                if (!frame.fin || frame.payload.size() > 125 || frame.opcode > WSOPC_PONG) {
                     theClient->sendDisconnect();
-                    goto websock_loop_exit;
+                    break;
                 }
 
-                uint8_t opc = first & 0x0F;
+                if (frame.opcode == WSOPC_DISCONNECT)
+                    break;
 
-                if (!receivingFragment)
-                    realOpc = opc;
+                if (frame.opcode == WSOPC_PING)
+                    theClient->sendRaw(WSOPC_PONG, frame.payload.data(), frame.payload.size());
 
-                if (receivingFragment && opc != WSOPC_CONTINUATION) {
-                    theClient->sendDisconnect();
-                    goto websock_loop_exit;
-                }
+                continue;
+            }
 
-                if (opc == WSOPC_DISCONNECT) {
-                    goto websock_loop_exit;
-                }
+            if (receivingFragments != (frame.opcode == WSOPC_CONTINUATION)) {
+                theClient->sendDisconnect();
+                break;
+            }
 
-                size_t payloadLength = second & 0x7F;
-                if (payloadLength == 126) {
-                    client.receive(buffer, 2);
-                    payloadLength = ntohs(*reinterpret_cast<uint16_t *>(buffer));
-                } else if (payloadLength == 127) {
-                    client.receive(&payloadLength, 8);
-                    payloadLength = be64toh(payloadLength);
-
-                    if (payloadLength & (1ull << 63)) {
-                        theClient->sendDisconnect();
-                        break;
-                    }
-                }
+            std::span<const uint8_t> data = frame.payload;
 
-                uint32_t key;
-                if (msk) {
-                    client.receive(&key, 4);
-                    key = ntohl(key);
+            if (receivingFragments || !frame.fin) {
+                if (!receivingFragments) {
+                    message.clear();
+                    messageOpcode     = frame.opcode;
+                    messageCompressed = compressed;
                 }
 
-                size_t rl = 0;
-
-                if (totalLength + payloadLength > MAX_ALLOWED_WS_FRAME_LENGTH) {
+                if (message.size() + data.size() > MAX_ALLOWED_WS_FRAME_LENGTH) {
                     theClient->sendDisconnect();
-                    goto websock_loop_exit;
+                    break;
                 }
 
-                contentBuffer.resize(totalLength + payloadLength);
+                message.insert(message.end(), data.begin(), data.end());
+                receivingFragments = !frame.fin;
 
-                while (rl < payloadLength)
-                    rl += client.receive(contentBuffer.data() + totalLength + rl, std::min<size_t>(32768, payloadLength - rl));
+                if (receivingFragments)
+                    continue;
+
+                data = message;
+            } else {
+                messageOpcode     = frame.opcode;
+                messageCompressed = compressed;
+            }
 
-                if (msk) {
-                    for (size_t i = 0, o = 0; i < payloadLength; i++, o = i % 4) {
-                        uint8_t shift = (3 - o) << 3;
-                        contentBuffer[i + totalLength] ^= (shift == 0 ? key : (key >> shift)) & 0xFF;
-                    }
+#ifdef TINYHTTP_COMPRESSION
+            if (messageCompressed) {
+                if (!theClient->mDeflate->inflate(data, inflated)) {
+                    theClient->sendDisconnect();
+                    break;
                 }
 
-                totalLength += payloadLength;
-                receivingFragment = true;
-            } while (!fin);
+                data = inflated;
+            }
+#endif
+
+            if (messageOpcode == WSOPC_TEXT) {
+                theClient->onTextMessage(std::string(reinterpret_cast<const char *>(data.data()), data.size()));
+            } else if (messageOpcode == WSOPC_BINARY) {
+                // The handler takes a vector, a message that isn't in one yet is copied
+                if (data.data() != message.data() && data.data() != inflated.data())
+                    message.assign(data.begin(), data.end());
 
-            switch (realOpc) {
-                case WSOPC_TEXT:
-                    theClient->onTextMessage(std::string(reinterpret_cast<char *>(contentBuffer.data()), contentBuffer.size()));
-                    break;
-                case WSOPC_BINARY:
-                    theClient->onBinaryMessage(contentBuffer);
-                    break;
-                case WSOPC_PING:
-                    theClient->sendRaw(WSOPC_PONG, contentBuffer.data(), contentBuffer.size());
-                    break;
-                default:
-                    theClient->sendDisconnect();
-                    goto websock_loop_exit;
+                theClient->onBinaryMessage(data.data() == inflated.data() ? inflated : message);
+            } else {
+                theClient->sendDisconnect();
+                break;
             }
         }
     } catch (std::exception &e) {
         std::cerr << "WebSocket closed due to an exception (" << e.what() << ")\n";
     }
 
-websock_loop_exit:
     theClient->onDisconnect();
+    theClient->leaveTopics();
 }
 
-void WebsockClientHandler::sendRaw(uint8_t opcode, const void *data, size_t length, bool mask) {
-    if (!mClient) return;
+// Writes the header of a frame with a payload of length bytes, returns its size (at most 14 bytes)
+static size_t writeFrameHeader(uint8_t *header, uint8_t first, uint64_t length, const uint8_t *maskKey) noexcept {
+    size_t headerLength = 2;
+    header[0]           = first;
+
+    if (length < 126) {
+        header[1] = static_cast<uint8_t>(length);
+    } else if (length <= UINT16_MAX) {
+        header[1] = 126;
+        header[2] = static_cast<uint8_t>(length >> 8);
+        header[3] = static_cast<uint8_t>(length);
+        headerLength += 2;
+    } else {
+        header[1] = 127;
+        for (size_t i = 0; i < 8; i++)
+            header[2 + i] = static_cast<uint8_t>(length >> (56 - i * 8));
+        headerLength += 8;
+    }
+
+    if (maskKey) {
+        header[1] |= 0x80;
+        memcpy(header + headerLength, maskKey, 4);
+        headerLength += 4;
+    }
 
-    size_t bufferPosition = 0, headerPosition;
+    return headerLength;
+}
 
-    size_t allocLen = 2 + std::min<size_t>(length, WS_FRAGMENT_THRESHOLD);
+// A whole unmasked frame in one buffer. The output queues of all subscribers it goes to share it
+static std::shared_ptr<const std::vector<uint8_t>> makeSharedFrame(uint8_t first, const void *payload, size_t length) {
+    uint8_t header[14];
+    size_t headerLength = writeFrameHeader(header, first, length, nullptr);
 
-    if (mask)
-        allocLen += 4;
+    auto frame = std::make_shared<std::vector<uint8_t>>();
+    frame->reserve(headerLength + length);
+    frame->insert(frame->end(), header, header + headerLength);
+    frame->insert(frame->end(), static_cast<const uint8_t *>(payload), static_cast<const uint8_t *>(payload) + length);
 
-    if (WS_FRAGMENT_THRESHOLD > UINT16_MAX)
-        allocLen += 8;
-    else if (WS_FRAGMENT_THRESHOLD > 126)
-        allocLen += 2;
+    return frame;
+}
 
-    uint8_t *packetBuffer = new uint8_t[allocLen];
+void WebsockClientHandler::sendRaw(uint8_t opcode, const void *data, size_t length, bool mask) {
+    if (!mClient) return;
 
+    if (!sendMessage(opcode, data, length, mask, SIZE_MAX) || !waitForOutput())
+        onDisconnect();
+}
+
+bool WebsockClientHandler::sendMessage(uint8_t opcode, const void *data, size_t length, bool mask, size_t limit) {
     if (!data)
         length = 0;
 
-    const uint8_t *data_u8 = reinterpret_cast<const uint8_t *>(data);
-    uint32_t key           = static_cast<uint32_t>(rand());
+#ifdef TINYHTTP_COMPRESSION
+    WebsockDeflate *deflate = mDeflate.get();
 
-    do {
-        headerPosition  = 2;
-        packetBuffer[0] = opcode & 0xF;
-        packetBuffer[1] = 0;
-
-        opcode = WSOPC_CONTINUATION;
-
-        if ((length - bufferPosition) <= WS_FRAGMENT_THRESHOLD)
-            packetBuffer[0] |= 0x80; // fin
-
-        if (mask)
-            packetBuffer[1] |= 0x80;
-
-        size_t lengthToSend = std::min<size_t>(WS_FRAGMENT_THRESHOLD, (length - bufferPosition));
-
-        if (lengthToSend < 126) {
-            packetBuffer[1] |= static_cast<uint8_t>(lengthToSend);
-        } else if (lengthToSend <= UINT16_MAX) {
-            packetBuffer[1] |= 126;
-            *reinterpret_cast<uint16_t *>(&packetBuffer[headerPosition]) = htobe16(static_cast<uint16_t>(lengthToSend));
-            headerPosition += 2;
-        } else {
-            packetBuffer[1] |= 127;
-            *reinterpret_cast<uint64_t *>(&packetBuffer[headerPosition]) = htobe64(static_cast<uint64_t>(lengthToSend));
-            headerPosition += 8;
+    if (deflate && deflate->compresses(opcode, length)) {
+        thread_local std::vector<uint8_t> compressed;
+
+        if (!deflate->serverTakeover) {
+            WebsockDeflater &deflater = WebsockDeflater::forThread(deflate->serverWindowBits);
+            deflater.reset();
+            deflater.compress(data, length, compressed);
+
+            return sendFrames(opcode, 0x40, compressed.data(), compressed.size(), mask, limit);
         }
 
+#ifdef TINYHTTP_THREADING
+        std::lock_guard lock{deflate->mutex};
+#endif
+
+        if (!deflate->deflater)
+            deflate->deflater = std::make_unique<WebsockDeflater>(deflate->serverWindowBits);
+
+        deflate->deflater->compress(data, length, compressed);
+        return sendFrames(opcode, 0x40, compressed.data(), compressed.size(), mask, limit);
+    }
+#endif
+
+    return sendFrames(opcode, 0, reinterpret_cast<const uint8_t *>(data), length, mask, limit);
+}
+
+bool WebsockClientHandler::sendFrames(uint8_t opcode, uint8_t reserved, const uint8_t *payload, size_t length, bool mask, size_t limit) {
+    size_t fragmentSize = mFragmentSize > 0 ? mFragmentSize : length;
+    size_t position     = 0;
+
+    uint8_t key[4];
+    if (mask) {
+        uint32_t random = static_cast<uint32_t>(rand());
+        memcpy(key, &random, sizeof(key));
+    }
+
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mSendMutex};
+#endif
+
+    do {
+        size_t frameLength = std::min(fragmentSize, length - position);
+        bool fin           = position + frameLength == length;
+
+        uint8_t header[14];
+        size_t headerLength = writeFrameHeader(header, (fin ? 0x80 : 0) | reserved | (opcode & 0x0F), frameLength, mask ? key : nullptr);
+
+        // Header and payload go out in one send. Frames of other messages can't get between the fragments,
+        // every message is sent under the lock
+        SendSlice slices[] = {{header, headerLength}, {payload + position, frameLength}};
+
         if (mask) {
-            *reinterpret_cast<uint32_t *>(&packetBuffer[headerPosition]) = htobe32(static_cast<uint32_t>(key));
-            headerPosition += 4;
+            thread_local std::vector<uint8_t> maskedPayload;
+
+            maskedPayload.resize(frameLength);
+            maskWebsockPayload(maskedPayload.data(), payload + position, frameLength, key);
+            slices[1].data = maskedPayload.data();
+        }
+
+        opcode   = WSOPC_CONTINUATION;
+        reserved = 0;
+
+        // Only checked before the first frame, a message that was started is queued whole
+        if (!queueFrame(slices, std::size(slices), limit))
+            return false;
+
+        limit = SIZE_MAX;
+
+        position += frameLength;
+    } while (position < length);
+
+    return true;
+}
+
+bool WebsockClientHandler::queueFrame(const SendSlice *slices, size_t count, size_t limit) {
+    try {
+        if (mClient->queue(slices, count, limit))
+            return true;
+
+        // Closed instead of waited for, its own thread ends the connection
+        std::cerr << "WebSocket client fell behind, closing it" << std::endl;
+        mClient->interrupt();
+    } catch (std::runtime_error &e) {
+        std::cerr << "WebSocket send failed (" << e.what() << ")" << std::endl;
+    }
+
+    mClient->mErrorFlag = true;
+    return false;
+}
+
+bool WebsockClientHandler::waitForOutput() {
+    try {
+        // Waits for a client that fell behind instead of queueing without bounds
+        if (mClient->pendingOutput() > TINYHTTP_OUTPUT_HIGH_WATERMARK)
+            mClient->drainOutput(TINYHTTP_OUTPUT_LOW_WATERMARK);
+    } catch (std::runtime_error &e) {
+        std::cerr << "WebSocket send failed (" << e.what() << ")" << std::endl;
+        mClient->mErrorFlag = true;
+        return false;
+    }
 
-            for (size_t i = 0, o = 0; i < lengthToSend; i++, o = i % 4) {
-                uint8_t shift                    = (3 - o) << 3;
-                packetBuffer[i + headerPosition] = data_u8[i + bufferPosition] ^ ((shift == 0 ? key : (key >> shift)) & 0xFF);
+    return true;
+}
+
+void WebsockClientHandler::leaveTopics() {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mSubscriber->mutex};
+#endif
+
+    mSubscriber->handler = nullptr;
+
+    for (WebsockTopic *topic : mSubscriber->topics)
+        topic->remove(mSubscriber);
+
+    mSubscriber->topics.clear();
+}
+
+std::shared_ptr<const WebsockTopic::SubscriberList> WebsockTopic::subscribers() const {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mMutex};
+#endif
+
+    return mSubscribers;
+}
+
+void WebsockTopic::subscribe(WebsockClientHandler &client) {
+    auto &subscriber = client.mSubscriber;
+
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{subscriber->mutex};
+#endif
+
+    auto &topics = subscriber->topics;
+    if (!subscriber->handler || std::find(topics.begin(), topics.end(), this) != topics.end())
+        return;
+
+    topics.push_back(this);
+
+#ifdef TINYHTTP_THREADING
+    std::lock_guard listLock{mMutex};
+#endif
+
+    auto extended = std::make_shared<SubscriberList>(*mSubscribers);
+    extended->push_back(subscriber);
+    mSubscribers = std::move(extended);
+}
+
+void WebsockTopic::unsubscribe(WebsockClientHandler &client) {
+    auto &subscriber = client.mSubscriber;
+
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{subscriber->mutex};
+#endif
+
+    auto &topics = subscriber->topics;
+    auto it      = std::find(topics.begin(), topics.end(), this);
+
+    if (it != topics.end()) {
+        topics.erase(it);
+        remove(subscriber);
+    }
+}
+
+void WebsockTopic::remove(const std::shared_ptr<WebsockSubscriber> &subscriber) {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mMutex};
+#endif
+
+    auto reduced = std::make_shared<SubscriberList>(*mSubscribers);
+    std::erase(*reduced, subscriber);
+    mSubscribers = std::move(reduced);
+}
+
+size_t WebsockTopic::publish(uint8_t opcode, const void *data, size_t length, const WebsockClientHandler *except) {
+    auto list = subscribers();
+    if (list->empty())
+        return 0;
+
+    if (!data)
+        length = 0;
+
+    // Made once the first subscriber needs it. Queues that wait for a subscriber hold on to it, not to a copy
+    std::shared_ptr<const std::vector<uint8_t>> frame;
+
+#ifdef TINYHTTP_COMPRESSION
+    // Subscribers without context takeover share one compressed frame, made once the first of them needs it.
+    // It's made again only for a smaller window, any client can read one smaller than it allowed
+    thread_local std::vector<uint8_t> compressed;
+    std::shared_ptr<const std::vector<uint8_t>> compressedFrame;
+    int compressedWindowBits = 0;
+#endif
+
+    size_t delivered = 0;
+
+    for (auto &subscriber : *list) {
+#ifdef TINYHTTP_THREADING
+        std::lock_guard lock{subscriber->mutex};
+#endif
+
+        WebsockClientHandler *handler = subscriber->handler;
+        if (!handler || handler == except)
+            continue;
+
+        SendSlice slice{};
+
+#ifdef TINYHTTP_COMPRESSION
+        WebsockDeflate *deflate = handler->mDeflate.get();
+
+        if (deflate && deflate->compresses(opcode, length)) {
+            // Compressed with the subscriber's own window, nobody else could read it
+            if (deflate->serverTakeover) {
+                if (handler->sendMessage(opcode, data, length, false, TINYHTTP_OUTPUT_HIGH_WATERMARK))
+                    delivered++;
+
+                continue;
+            }
+
+            if (!compressedWindowBits || deflate->serverWindowBits < compressedWindowBits) {
+                WebsockDeflater &deflater = WebsockDeflater::forThread(deflate->serverWindowBits);
+                deflater.reset();
+                deflater.compress(data, length, compressed);
+
+                compressedFrame      = makeSharedFrame(0xC0 | (opcode & 0x0F), compressed.data(), compressed.size());
+                compressedWindowBits = deflate->serverWindowBits;
             }
-        } else {
-            memcpy(packetBuffer + headerPosition, data_u8 + bufferPosition, lengthToSend);
+
+            slice = {compressedFrame->data(), compressedFrame->size(), compressedFrame};
         }
+#endif
 
-        try {
-            mClient->send(packetBuffer, lengthToSend + headerPosition);
-        } catch (std::runtime_error &e) {
-            std::cerr << "WebSocket send failed (" << e.what() << ")" << std::endl;
-            onDisconnect();
-            mClient->mErrorFlag = true;
-            goto cleanup;
+        if (!slice.owner) {
+            if (!frame)
+                frame = makeSharedFrame(0x80 | (opcode & 0x0F), data, length);
+
+            slice = {frame->data(), frame->size(), frame};
         }
 
-        bufferPosition += lengthToSend;
-    } while (bufferPosition < length);
+#ifdef TINYHTTP_THREADING
+        std::lock_guard sendLock{handler->mSendMutex};
+#endif
+
+        if (handler->queueFrame(&slice, 1, TINYHTTP_OUTPUT_HIGH_WATERMARK))
+            delivered++;
+    }
+
+    return delivered;
+}
+
+WebsockTopic &WebsockHub::topic(std::string_view name) {
+#ifdef TINYHTTP_THREADING
+    std::lock_guard lock{mMutex};
+#endif
+
+    auto it = mTopics.find(name);
+    if (it == mTopics.end())
+        it = mTopics.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple()).first;
 
-cleanup:
-    delete[] packetBuffer;
+    return it->second;
 }
 
-void WebsockClientHandler::sendDisconnect() {
-    sendRaw(WSOPC_DISCONNECT, nullptr, 0);
+void WebsockClientHandler::sendDisconnect(uint16_t code) {
+    uint8_t payload[2] = {static_cast<uint8_t>(code >> 8), static_cast<uint8_t>(code)};
+    sendRaw(WSOPC_DISCONNECT, payload, code ? sizeof(payload) : 0);
 }
 
 void WebsockClientHandler::sendText(const std::string &str) {